@@ -0,0 +1,207 @@
+/*************************************************************************
+ * Copyright (c) 2020, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+/* Minimal key-value server for NCCL_BOOTSTRAP_STORE=tcp:<host>:<port>.
+ * It keeps keys in memory and serves one request at a time.
+ *
+ * Each request starts with a header giving the operation, the key size and
+ * the value size, followed by the key (without NUL) and, for SET, the value.
+ * GET is answered with the value size and the value, once the key is set.
+ * SET and REMOVE are not answered.
+ *
+ * Usage : nccl-store-server <port>
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define STORE_SET 0
+#define STORE_GET 1
+#define STORE_REMOVE 2
+#define MAX_KEY_SIZE 128
+#define MAX_VALUE_SIZE (1<<20)
+
+struct header {
+  int op;
+  int keySize;
+  int valueSize;
+};
+
+struct entry {
+  char key[MAX_KEY_SIZE];
+  char* value;
+  int size;
+  struct entry* next;
+};
+
+struct waiter {
+  int fd;
+  char key[MAX_KEY_SIZE];
+  struct waiter* next;
+};
+
+static struct entry* entries = NULL;
+static struct waiter* waiters = NULL;
+
+static int fullIo(int fd, void* ptr, int size, int send) {
+  int offset = 0;
+  while (offset < size) {
+    int bytes = send ? write(fd, (char*)ptr+offset, size-offset) : read(fd, (char*)ptr+offset, size-offset);
+    if (bytes == -1 && errno == EINTR) continue;
+    if (bytes <= 0) return -1;
+    offset += bytes;
+  }
+  return 0;
+}
+
+static struct entry** findEntry(const char* key) {
+  struct entry** e = &entries;
+  while (*e && strcmp((*e)->key, key) != 0) e = &(*e)->next;
+  return e;
+}
+
+static int reply(int fd, struct entry* e) {
+  if (fullIo(fd, &e->size, sizeof(int), 1) != 0) return -1;
+  return fullIo(fd, e->value, e->size, 1);
+}
+
+static void dropWaiters(int fd) {
+  struct waiter** w = &waiters;
+  while (*w) {
+    if ((*w)->fd == fd) {
+      struct waiter* old = *w;
+      *w = old->next;
+      free(old);
+    } else {
+      w = &(*w)->next;
+    }
+  }
+}
+
+// Returns -1 if the client is gone or sent an invalid request
+static int handleRequest(int fd) {
+  struct header hdr;
+  char key[MAX_KEY_SIZE];
+  if (fullIo(fd, &hdr, sizeof(hdr), 0) != 0) return -1;
+  if (hdr.keySize <= 0 || hdr.keySize >= MAX_KEY_SIZE || hdr.valueSize < 0 || hdr.valueSize > MAX_VALUE_SIZE) {
+    fprintf(stderr, "Invalid request : op %d key size %d value size %d\n", hdr.op, hdr.keySize, hdr.valueSize);
+    return -1;
+  }
+  if (fullIo(fd, key, hdr.keySize, 0) != 0) return -1;
+  key[hdr.keySize] = '\0';
+  struct entry** e = findEntry(key);
+  if (hdr.op == STORE_SET) {
+    char* value = malloc(hdr.valueSize ? hdr.valueSize : 1);
+    if (value == NULL || fullIo(fd, value, hdr.valueSize, 0) != 0) {
+      free(value);
+      return -1;
+    }
+    if (*e == NULL) {
+      *e = calloc(1, sizeof(struct entry));
+      if (*e == NULL) return -1;
+      strcpy((*e)->key, key);
+    }
+    free((*e)->value);
+    (*e)->value = value;
+    (*e)->size = hdr.valueSize;
+    // Answer the clients waiting for that key
+    struct waiter** w = &waiters;
+    while (*w) {
+      if (strcmp((*w)->key, key) == 0) {
+        struct waiter* old = *w;
+        *w = old->next;
+        reply(old->fd, *e);
+        free(old);
+      } else {
+        w = &(*w)->next;
+      }
+    }
+  } else if (hdr.op == STORE_GET) {
+    if (*e) return reply(fd, *e);
+    struct waiter* w = calloc(1, sizeof(struct waiter));
+    if (w == NULL) return -1;
+    w->fd = fd;
+    strcpy(w->key, key);
+    w->next = waiters;
+    waiters = w;
+  } else if (hdr.op == STORE_REMOVE) {
+    if (*e) {
+      struct entry* old = *e;
+      *e = old->next;
+      free(old->value);
+      free(old);
+    }
+  } else {
+    fprintf(stderr, "Invalid operation %d\n", hdr.op);
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage : %s <port>\n", argv[0]);
+    return 1;
+  }
+  int lfd = socket(AF_INET6, SOCK_STREAM, 0);
+  int one = 1;
+  struct sockaddr_in6 addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  addr.sin6_port = htons(atoi(argv[1]));
+  if (lfd == -1 || setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+      bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(lfd, 16384) != 0) {
+    perror("listen");
+    return 1;
+  }
+
+  int maxFds = 1024, nfds = 1;
+  struct pollfd* pfds = calloc(maxFds, sizeof(struct pollfd));
+  if (pfds == NULL) return 1;
+  pfds[0].fd = lfd;
+  pfds[0].events = POLLIN;
+  while (1) {
+    if (poll(pfds, nfds, -1) == -1) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      return 1;
+    }
+    for (int i=nfds-1; i>0; i--) {
+      if (pfds[i].revents == 0) continue;
+      if (handleRequest(pfds[i].fd) != 0) {
+        dropWaiters(pfds[i].fd);
+        close(pfds[i].fd);
+        pfds[i] = pfds[--nfds];
+      }
+    }
+    if (pfds[0].revents) {
+      int fd = accept(lfd, NULL, NULL);
+      if (fd == -1) continue;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      if (nfds == maxFds) {
+        struct pollfd* newPfds = realloc(pfds, 2*maxFds*sizeof(struct pollfd));
+        if (newPfds == NULL) {
+          close(fd);
+          continue;
+        }
+        pfds = newPfds;
+        maxFds *= 2;
+      }
+      pfds[nfds].fd = fd;
+      pfds[nfds].events = POLLIN;
+      pfds[nfds++].revents = 0;
+    }
+  }
+  return 0;
+}
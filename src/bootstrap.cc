@@ -10,8 +10,11 @@
 #include "bootstrap.h"
 #include "net.h"
 #include "socket.h"
+#include "store.h"
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <ctype.h>
 
 struct bootstrapNetComm {
   int fd;
@@ -140,6 +143,100 @@ static ncclResult_t bootstrapNetRecv(void* recvComm, void* data, int size) {
   return ncclSuccess;
 }
 
+// Send to one peer while receiving from another. Ranks exchanging data in a
+// cycle would otherwise all block on full socket buffers. A NULL comm skips
+// that direction.
+static ncclResult_t bootstrapNetSendRecv(void* sendComm, void* sendData, int sendSize, void* recvComm, void* recvData, int recvSize) {
+  struct bootstrapNetComm* sComm = (struct bootstrapNetComm*)sendComm;
+  struct bootstrapNetComm* rComm = (struct bootstrapNetComm*)recvComm;
+  int recvHdr = 0;
+  int sendHdrOffset = sComm ? 0 : sizeof(int), sendOffset = 0;
+  int recvHdrOffset = rComm ? 0 : sizeof(int), recvOffset = 0;
+  if (sComm == NULL) sendSize = 0;
+  while (sendHdrOffset < sizeof(int) || sendOffset < sendSize || recvHdrOffset < sizeof(int) || recvOffset < recvHdr) {
+    int progress = sendHdrOffset+sendOffset+recvHdrOffset+recvOffset;
+    if (sendHdrOffset < sizeof(int)) NCCLCHECK(socketProgress(NCCL_SOCKET_SEND, sComm->fd, &sendSize, sizeof(int), &sendHdrOffset));
+    if (sendHdrOffset == sizeof(int) && sendOffset < sendSize) NCCLCHECK(socketProgress(NCCL_SOCKET_SEND, sComm->fd, sendData, sendSize, &sendOffset));
+    if (recvHdrOffset < sizeof(int)) {
+      NCCLCHECK(socketProgress(NCCL_SOCKET_RECV, rComm->fd, &recvHdr, sizeof(int), &recvHdrOffset));
+      if (recvHdrOffset == sizeof(int) && recvHdr > recvSize) {
+        WARN("Message truncated : received %d bytes instead of %d\n", recvHdr, recvSize);
+        return ncclInternalError;
+      }
+    }
+    if (recvHdrOffset == sizeof(int) && recvOffset < recvHdr) NCCLCHECK(socketProgress(NCCL_SOCKET_RECV, rComm->fd, recvData, recvHdr, &recvOffset));
+    if (sendHdrOffset+sendOffset+recvHdrOffset+recvOffset == progress) {
+      struct pollfd pfd[2];
+      int nfds = 0;
+      if (sendHdrOffset < sizeof(int) || sendOffset < sendSize) {
+        pfd[nfds].fd = sComm->fd;
+        pfd[nfds++].events = POLLOUT;
+      }
+      if (recvHdrOffset < sizeof(int) || recvOffset < recvHdr) {
+        pfd[nfds].fd = rComm->fd;
+        pfd[nfds++].events = POLLIN;
+      }
+      SYSCHECK(poll(pfd, nfds, -1), "poll");
+    }
+  }
+  return ncclSuccess;
+}
+
+/* Ranks on the same node talk to their node leader through Unix sockets.
+ * Each rank listens on an abstract socket named after its TCP listen
+ * address, which is unique on the node, so that other ranks can find the
+ * listener of their leader from the table of handles.
+ */
+static void bootstrapLocalAddr(ncclNetHandle_t* netHandle, struct sockaddr_un* addr, socklen_t* len) {
+  static_assert(sizeof("nccl-bootstrap-")+2*sizeof(union socketAddress) < sizeof(addr->sun_path), "Local socket name too long");
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  // Leading NUL : abstract namespace, nothing to clean up in the filesystem
+  int n = sprintf(addr->sun_path+1, "nccl-bootstrap-");
+  const uint8_t* bytes = (const uint8_t*)netHandle;
+  for (int i=0; i<sizeof(union socketAddress); i++) n += sprintf(addr->sun_path+1+n, "%02x", bytes[i]);
+  *len = offsetof(struct sockaddr_un, sun_path)+1+n;
+}
+
+static ncclResult_t bootstrapLocalListen(ncclNetHandle_t* netHandle, void** listenComm) {
+  struct sockaddr_un addr;
+  socklen_t len;
+  bootstrapLocalAddr(netHandle, &addr, &len);
+  struct bootstrapNetComm* comm;
+  NCCLCHECK(bootstrapNetNewComm(&comm));
+  SYSCHECKVAL(socket(AF_UNIX, SOCK_STREAM, 0), "socket", comm->fd);
+  SYSCHECK(bind(comm->fd, (struct sockaddr*)&addr, len), "bind");
+  SYSCHECK(listen(comm->fd, 16384), "listen");
+  *listenComm = comm;
+  return ncclSuccess;
+}
+
+static ncclResult_t bootstrapLocalConnect(ncclNetHandle_t* netHandle, void** sendComm) {
+  struct sockaddr_un addr;
+  socklen_t len;
+  bootstrapLocalAddr(netHandle, &addr, &len);
+  struct bootstrapNetComm* comm;
+  NCCLCHECK(bootstrapNetNewComm(&comm));
+  SYSCHECKVAL(socket(AF_UNIX, SOCK_STREAM, 0), "socket", comm->fd);
+  if (connect(comm->fd, (struct sockaddr*)&addr, len) != 0) {
+    WARN("Bootstrap : could not connect to local socket %s : %s", addr.sun_path+1, strerror(errno));
+    bootstrapNetClose(comm);
+    return ncclSystemError;
+  }
+  *sendComm = comm;
+  return ncclSuccess;
+}
+
+// Abstract sockets are only visible inside a network namespace, so ranks of
+// the same host in different namespaces have to be different nodes here.
+static uint64_t bootstrapHostHash() {
+  uint64_t hash = getHostHash();
+  char netNs[64];
+  ssize_t n = readlink("/proc/self/ns/net", netNs, sizeof(netNs));
+  if (n > 0) hash ^= getHash(netNs, n);
+  return hash;
+}
+
 ncclResult_t bootstrapNetCreateHandle(ncclNetHandle_t* netHandle, const char* str) {
   union socketAddress* connectAddr = (union socketAddress*) netHandle;
   NCCLCHECK(GetSocketAddrFromString(connectAddr, str));
@@ -149,12 +246,122 @@ ncclResult_t bootstrapNetCreateHandle(ncclNetHandle_t* netHandle, const char* st
 struct extInfo {
   int rank;
   int nranks;
-  ncclNetHandle_t extHandleListenRoot;
   ncclNetHandle_t extHandleListen;
 };
 
+/* Ranks exchange their listen handles through a tree. The root only tells
+ * each rank, in the order they check in, its index in the tree and the
+ * handle of its parent, which checked in before it. Each rank then gathers
+ * the handles of its subtree from its children and sends them to its
+ * parent. The first rank to check in ends up with all handles, which flow
+ * back down the tree, so that the root does no more than one accept and
+ * one small reply per rank.
+ */
+#define BOOTSTRAP_TREE_ARITY 8
+
+struct extTreeInfo {
+  int index;
+  ncclNetHandle_t extHandleParent;
+};
+
+struct extRankHandle {
+  int rank;
+  uint64_t hostHash;
+  ncclNetHandle_t handle;
+};
+
+/* With a rendezvous store, the unique id holds a key prefix instead of the
+ * address of a root. Each rank publishes its info under <prefix>-<rank> and
+ * joins the tree at index rank, fetching the info of its parent from the
+ * store, so there is no root thread.
+ */
+#define BOOTSTRAP_STORE_MAGIC 0x524f54534c43434eULL // "NCCLSTOR"
+#define BOOTSTRAP_STORE_PREFIX_MAXSIZE 64
+
+struct bootstrapStoreId {
+  uint64_t magic;
+  char prefix[BOOTSTRAP_STORE_PREFIX_MAXSIZE];
+};
+
+static bool bootstrapIsStoreId(ncclUniqueId* id) {
+  return ((struct bootstrapStoreId*)id)->magic == BOOTSTRAP_STORE_MAGIC;
+}
+
+// Ids derived from NCCL_COMM_ID are the same on all ranks, and across
+// restarts, so they do not need to be broadcast. Other ids are random.
+static ncclResult_t bootstrapStoreCreateId(ncclUniqueId* id, const char* commId) {
+  struct bootstrapStoreId* storeId = (struct bootstrapStoreId*)id;
+  static_assert(sizeof(struct bootstrapStoreId) <= sizeof(ncclUniqueId), "Store id does not fit inside ncclUniqueId");
+  static_assert(BOOTSTRAP_STORE_PREFIX_MAXSIZE+16 <= NCCL_STORE_KEY_MAXSIZE, "Store prefix is too long for keys");
+  storeId->magic = BOOTSTRAP_STORE_MAGIC;
+  if (commId) {
+    if (strlen(commId) >= BOOTSTRAP_STORE_PREFIX_MAXSIZE) {
+      WARN("NCCL_COMM_ID %s is too long to name a store rendezvous", commId);
+      return ncclInvalidArgument;
+    }
+    // Keep keys usable as file names
+    for (int i=0; commId[i]; i++) storeId->prefix[i] = isalnum(commId[i]) || commId[i] == '-' || commId[i] == '.' ? commId[i] : '_';
+  } else {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    snprintf(storeId->prefix, BOOTSTRAP_STORE_PREFIX_MAXSIZE, "nccl-%016lx-%016lx",
+        getHostHash()+getPidHash(), ts.tv_sec*1000000000UL+ts.tv_nsec);
+  }
+  return ncclSuccess;
+}
+
+static void bootstrapStoreKey(struct bootstrapStoreId* storeId, int rank, char* key) {
+  snprintf(key, NCCL_STORE_KEY_MAXSIZE, "%s-%d", storeId->prefix, rank);
+}
+
+// Fetch the listen handle of a parent from the store
+static ncclResult_t bootstrapStoreGetParent(ncclStore_t* store, void* storeComm, struct bootstrapStoreId* storeId, int parent, int nranks, ncclNetHandle_t* handle) {
+  char key[NCCL_STORE_KEY_MAXSIZE];
+  struct extInfo parentInfo;
+  bootstrapStoreKey(storeId, parent, key);
+  NCCLCHECK(store->get(storeComm, key, &parentInfo, sizeof(struct extInfo)));
+  if (parentInfo.rank != parent || parentInfo.nranks != nranks) {
+    WARN("Bootstrap : store key %s holds rank %d of %d ranks instead of rank %d of %d", key, parentInfo.rank, parentInfo.nranks, parent, nranks);
+    return ncclInvalidUsage;
+  }
+  memcpy(handle, parentInfo.extHandleListen, sizeof(ncclNetHandle_t));
+  return ncclSuccess;
+}
+
+// Publish my info, and get where I am in the tree
+static ncclResult_t bootstrapStoreJoin(ncclStore_t* store, void* storeComm, struct bootstrapStoreId* storeId, struct extInfo* info, struct extTreeInfo* treeInfo) {
+  char key[NCCL_STORE_KEY_MAXSIZE];
+  bootstrapStoreKey(storeId, info->rank, key);
+  NCCLCHECK(store->set(storeComm, key, info, sizeof(struct extInfo)));
+  treeInfo->index = info->rank;
+  if (info->rank > 0) {
+    int parent = (info->rank-1)/BOOTSTRAP_TREE_ARITY;
+    NCCLCHECK(bootstrapStoreGetParent(store, storeComm, storeId, parent, info->nranks, &treeInfo->extHandleParent));
+  }
+  return ncclSuccess;
+}
+
 #include <sys/resource.h>
 
+/* AllGather is done in two levels. Ranks first send their data to the
+ * leader of their node, which is the lowest rank with the same host hash.
+ * Leaders then exchange the data of their node with the Bruck algorithm :
+ * at step k, each leader sends what it gathered so far to the leader of
+ * node-2^k and receives as much from node+2^k, so it takes ceil(log2(nNodes))
+ * steps. Leaders keep a connection to each of these peers ; small node
+ * counts only use the first one, as a ring. Leaders finally send the result
+ * to the ranks of their node.
+ */
+#define BOOTSTRAP_MAX_PEERS 32
+#define BOOTSTRAP_RING_MAX_RANKS 4
+
+static int bootstrapNumPeers(int nranks) {
+  if (nranks <= BOOTSTRAP_RING_MAX_RANKS) return 1;
+  int nPeers = 0;
+  while ((1 << nPeers) < nranks) nPeers++;
+  return nPeers;
+}
+
 static ncclResult_t setFilesLimit() {
   struct rlimit filesLimit;
   SYSCHECK(getrlimit(RLIMIT_NOFILE, &filesLimit), "getrlimit");
@@ -165,66 +372,63 @@ static ncclResult_t setFilesLimit() {
 
 static void *bootstrapRoot(void* listenComm) {
   struct extInfo info;
-  ncclNetHandle_t *rankHandles = NULL;
-  ncclNetHandle_t *rankHandlesRoot = NULL; // for initial rank <-> root information exchange
-  ncclNetHandle_t zero = { 0 }; // for sanity checking
+  struct extTreeInfo treeInfo;
+  ncclNetHandle_t *treeHandles = NULL; // Listen handles in check-in order
+  char *checkedIn = NULL; // for sanity checking
   void* tmpComm;
   ncclResult_t res;
   setFilesLimit();
 
   TRACE(NCCL_INIT, "BEGIN");
-  /* Receive addresses from all ranks */
+  /* Receive addresses from all ranks, and tell each where it joins the tree */
   int nranks = 0, c = 0;
   do {
     NCCLCHECKGOTO(bootstrapNetAccept(listenComm, &tmpComm), res, out);
     NCCLCHECKGOTO(bootstrapNetRecv(tmpComm, &info, sizeof(info)), res, out);
-    NCCLCHECKGOTO(bootstrapNetCloseRecv(tmpComm), res, out);
 
     if (c == 0) {
       nranks = info.nranks;
-      NCCLCHECKGOTO(ncclCalloc(&rankHandles, nranks), res, out);
-      NCCLCHECKGOTO(ncclCalloc(&rankHandlesRoot, nranks), res, out);
+      NCCLCHECKGOTO(ncclCalloc(&treeHandles, nranks), res, out);
+      NCCLCHECKGOTO(ncclCalloc(&checkedIn, nranks), res, out);
     }
 
     if (nranks != info.nranks) {
       WARN("Bootstrap Root : mismatch in rank count from procs %d : %d", nranks, info.nranks);
+      bootstrapNetCloseRecv(tmpComm);
       goto out;
     }
 
-    if (memcmp(&zero, &rankHandlesRoot[info.rank], sizeof(ncclNetHandle_t)) != 0) {
+    if (info.rank < 0 || info.rank >= nranks || checkedIn[info.rank]) {
       WARN("Bootstrap Root : rank %d of %d ranks has already checked in", info.rank, nranks);
+      bootstrapNetCloseRecv(tmpComm);
       goto out;
     }
+    checkedIn[info.rank] = 1;
 
-    // Save the connection handle for that rank
-    memcpy(rankHandlesRoot+info.rank, info.extHandleListenRoot, sizeof(ncclNetHandle_t));
-    memcpy(rankHandles+info.rank, info.extHandleListen, sizeof(ncclNetHandle_t));
+    // Save the connection handle for that rank, and send it its parent's
+    memcpy(treeHandles+c, info.extHandleListen, sizeof(ncclNetHandle_t));
+    treeInfo.index = c;
+    if (c > 0) memcpy(treeInfo.extHandleParent, treeHandles+(c-1)/BOOTSTRAP_TREE_ARITY, sizeof(ncclNetHandle_t));
+    NCCLCHECKGOTO(bootstrapNetSend(tmpComm, &treeInfo, sizeof(treeInfo)), res, out);
+    NCCLCHECKGOTO(bootstrapNetCloseSend(tmpComm), res, out);
 
     ++c;
     TRACE(NCCL_INIT, "Received connect from rank %d total %d/%d",  info.rank, c, nranks);
   } while (c < nranks);
-  TRACE(NCCL_INIT, "COLLECTED ALL %d HANDLES", nranks);
-
-  // Send the connect handle for the next rank in the AllGather ring
-  for (int r=0; r<nranks; ++r) {
-    int next = (r+1) % nranks;
-    void *tmpSendComm;
-    NCCLCHECKGOTO(bootstrapNetConnect(0, rankHandlesRoot+r, &tmpSendComm), res, out);
-    NCCLCHECKGOTO(bootstrapNetSend(tmpSendComm, rankHandles+next, sizeof(ncclNetHandle_t)), res, out);
-    NCCLCHECKGOTO(bootstrapNetCloseSend(tmpSendComm), res, out);
-  }
-  TRACE(NCCL_INIT, "SENT OUT ALL %d HANDLES", nranks);
+  TRACE(NCCL_INIT, "PLACED ALL %d RANKS", nranks);
 
 out:
   bootstrapNetCloseListen(listenComm);
-  if (rankHandles) free(rankHandles);
-  if (rankHandlesRoot) free(rankHandlesRoot);
+  if (treeHandles) free(treeHandles);
+  if (checkedIn) free(checkedIn);
 
   TRACE(NCCL_INIT, "DONE");
   return NULL;
 }
 
 ncclResult_t bootstrapCreateRoot(ncclUniqueId* id, bool idFromEnv) {
+  // Ranks meet through the store, there is no root
+  if (bootstrapIsStoreId(id)) return ncclSuccess;
   ncclNetHandle_t* netHandle = (ncclNetHandle_t*) id;
   void* listenComm;
   NCCLCHECK(bootstrapNetListen(idFromEnv ? dontCareIf : 0, netHandle, &listenComm));
@@ -239,7 +443,9 @@ ncclResult_t bootstrapGetUniqueId(ncclUniqueId* id) {
   ncclNetHandle_t* netHandle = (ncclNetHandle_t*) id;
 
   char* env = getenv("NCCL_COMM_ID");
-  if (env) {
+  if (ncclStoreEnabled()) {
+    NCCLCHECK(bootstrapStoreCreateId(id, env));
+  } else if (env) {
     if (bootstrapNetCreateHandle(netHandle, env) != 0) {
       WARN("Invalid NCCL_COMM_ID, please use format: <ipv4>:<port> or [<ipv6>]:<port> or <hostname>:<port>");
       return ncclInvalidArgument;
@@ -251,26 +457,250 @@ ncclResult_t bootstrapGetUniqueId(ncclUniqueId* id) {
   return ncclSuccess;
 }
 
-struct unexConn {
+/* bootstrapSend/bootstrapRecv keep one connection per peer and direction,
+ * opened by the first send. Each message starts with its tag and size.
+ * Messages received while waiting for another one are queued, hashed by
+ * peer and tag, and kept in order for each of them.
+ */
+#define UNEX_HASH_SIZE 256
+
+struct unexMsg {
   int peer;
-  void* comm;
-  struct unexConn* next;
+  int tag;
+  int size;
+  char* data;
+  struct unexMsg* next;
+};
+
+struct msgHeader {
+  int tag;
+  int size;
 };
 
 struct extState {
   void* extBstrapListenComm;
-  void* extBstrapRingRecvComm;
-  void* extBstrapRingSendComm;
+  // Leader AllGather connections : we send to the leader of node-2^k and
+  // receive from the leader of node+2^k
+  void* extBstrapSendComms[BOOTSTRAP_MAX_PEERS];
+  void* extBstrapRecvComms[BOOTSTRAP_MAX_PEERS];
+  int nPeers;
   ncclNetHandle_t* peerBstrapHandles;
-  struct unexConn* unexpectedConnections;
+  void** peerSendComms;
+  void** peerRecvComms;
+  int* recvPeers; // Peers we have a receive connection from
+  int nRecvPeers;
+  struct pollfd* pfds; // Listen socket, then receive connections
+  struct unexMsg* unexpectedMessages[UNEX_HASH_SIZE];
+  int nUnexpected;
   int rank;
   int nranks;
   int dev;
+  // Node layout : ranks grouped by node, node n has nodeRanks[nodeStart[n]]
+  // to nodeRanks[nodeStart[n+1]-1], the first one being its leader.
+  int* nodeRanks;
+  int* nodeStart;
+  int nNodes;
+  int node;
+  int localRank;
+  int localRanks;
+  // Leaders : connections from the other local ranks, indexed by local rank.
+  // Other ranks : connection to their leader, at index 0.
+  void** localComms;
 };
 
+NCCL_PARAM(BootstrapHierarchy, "BOOTSTRAP_HIERARCHY", 1);
+
+// Group ranks by host hash, in order of their first rank. Without
+// hierarchy, each rank is a node of its own.
+static ncclResult_t bootstrapSetNodes(struct extState* state, uint64_t* hostHashes) {
+  int rank = state->rank;
+  int nranks = state->nranks;
+  int* rankNode;
+  int* fill;
+  uint64_t* nodeHashes;
+  NCCLCHECK(ncclCalloc(&rankNode, nranks));
+  NCCLCHECK(ncclCalloc(&fill, nranks));
+  NCCLCHECK(ncclCalloc(&nodeHashes, nranks));
+  NCCLCHECK(ncclCalloc(&state->nodeRanks, nranks));
+  NCCLCHECK(ncclCalloc(&state->nodeStart, nranks+1));
+  bool hierarchy = ncclParamBootstrapHierarchy() != 0;
+  int nNodes = 0;
+  for (int r=0; r<nranks; r++) {
+    int n = 0;
+    if (hierarchy) while (n < nNodes && nodeHashes[n] != hostHashes[r]) n++;
+    else n = nNodes;
+    if (n == nNodes) nodeHashes[nNodes++] = hostHashes[r];
+    rankNode[r] = n;
+    state->nodeStart[n+1]++;
+  }
+  for (int n=0; n<nNodes; n++) state->nodeStart[n+1] += state->nodeStart[n];
+  for (int r=0; r<nranks; r++) {
+    int n = rankNode[r];
+    if (r == rank) state->localRank = fill[n];
+    state->nodeRanks[state->nodeStart[n]+fill[n]++] = r;
+  }
+  state->nNodes = nNodes;
+  state->node = rankNode[rank];
+  state->localRanks = state->nodeStart[state->node+1]-state->nodeStart[state->node];
+  free(rankNode);
+  free(fill);
+  free(nodeHashes);
+  INFO(NCCL_INIT, "Bootstrap : rank %d is local rank %d/%d of node %d/%d", rank, state->localRank, state->localRanks, state->node, nNodes);
+  return ncclSuccess;
+}
+
+/* Connect to my parent, which acknowledges the tree index we expect it to
+ * have. Store keys are only removed once the tree is built, so after a
+ * crash a restarted rank can read the info its parent published in the
+ * previous run, and connect to a dead listener or to another rank. As
+ * parents listen before they publish their info, a failed connection means
+ * that the info is stale : fetch it again until the parent publishes its
+ * own. The tag is negative so that other accepts on the listen socket
+ * reject it.
+ */
+#define BOOTSTRAP_PARENT_TAG(index) (-1-(index))
+
+// Single connection attempt, *sendComm is NULL if it failed
+static ncclResult_t bootstrapNetTryConnect(ncclNetHandle_t* netHandle, void** sendComm) {
+  int fd, err;
+  *sendComm = NULL;
+  NCCLCHECK(connectStart(&fd, (union socketAddress*)netHandle, &err));
+  if (err == EINPROGRESS) {
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    socklen_t len = sizeof(int);
+    SYSCHECK(poll(&pfd, 1, -1), "poll");
+    SYSCHECK(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len), "getsockopt");
+  }
+  if (err != 0) {
+    close(fd);
+    return ncclSuccess;
+  }
+  SYSCHECK(fcntl(fd, F_SETFL, 0), "fcntl");
+  struct bootstrapNetComm* comm;
+  NCCLCHECK(bootstrapNetNewComm(&comm));
+  comm->fd = fd;
+  *sendComm = comm;
+  return ncclSuccess;
+}
+
+static ncclResult_t bootstrapConnectParent(struct extState* state, struct extTreeInfo* treeInfo,
+    ncclStore_t* store, void* storeComm, struct bootstrapStoreId* storeId, void** sendComm) {
+  int parent = (treeInfo->index-1)/BOOTSTRAP_TREE_ARITY;
+  for (int retry=0; ; retry++) {
+    void* comm = NULL;
+    int tag = BOOTSTRAP_PARENT_TAG(parent), ack = 0;
+    // Info from the root is always current, connectAddress retries until the parent listens
+    if (store) {
+      NCCLCHECK(bootstrapNetTryConnect(&treeInfo->extHandleParent, &comm));
+    } else {
+      NCCLCHECK(bootstrapNetConnect(state->dev, &treeInfo->extHandleParent, &comm));
+    }
+    if (comm && bootstrapNetSend(comm, &tag, sizeof(int)) == ncclSuccess &&
+        bootstrapNetRecv(comm, &ack, sizeof(int)) == ncclSuccess && ack == tag) {
+      *sendComm = comm;
+      return ncclSuccess;
+    }
+    if (comm) bootstrapNetCloseSend(comm);
+    if (store == NULL || retry == RETRY_REFUSED_TIMES) {
+      WARN("Bootstrap : rank %d could not connect to its parent at tree index %d", state->rank, parent);
+      return ncclSystemError;
+    }
+    if (retry % 1000 == 0) INFO(NCCL_INIT, "Bootstrap : rank %d could not reach its parent at tree index %d, fetching its info again", state->rank, parent);
+    usleep(SLEEP_INT);
+    NCCLCHECK(bootstrapStoreGetParent(store, storeComm, storeId, parent, state->nranks, &treeInfo->extHandleParent));
+  }
+}
+
+// Gather the handles of my subtree, mine first, send them up, and get all
+// handles and host hashes back.
+static ncclResult_t bootstrapTreeExchange(struct extState* state, struct extInfo* info, struct extTreeInfo* treeInfo,
+    ncclStore_t* store, void* storeComm, struct bootstrapStoreId* storeId) {
+  int rank = state->rank;
+  int nranks = state->nranks;
+  ncclResult_t res = ncclSuccess;
+  struct extRankHandle* handles = NULL;
+  uint64_t* hostHashes = NULL;
+  char* found = NULL;
+  void* tmpSendComm = NULL;
+  void* childComms[BOOTSTRAP_TREE_ARITY];
+  int nChildren = 0, nAccepted = 0;
+  int nHandles = 1;
+  for (int c=treeInfo->index*BOOTSTRAP_TREE_ARITY+1; c<=treeInfo->index*BOOTSTRAP_TREE_ARITY+BOOTSTRAP_TREE_ARITY && c<nranks; c++) nChildren++;
+
+  NCCLCHECKGOTO(ncclCalloc(&handles, nranks), res, out);
+  handles[0].rank = rank;
+  handles[0].hostHash = bootstrapHostHash();
+  memcpy(handles[0].handle, info->extHandleListen, sizeof(ncclNetHandle_t));
+  for (int c=0; c<nChildren; c++) {
+    int tag, count;
+    NCCLCHECKGOTO(bootstrapNetAccept(state->extBstrapListenComm, childComms+c), res, out);
+    nAccepted++;
+    NCCLCHECKGOTO(bootstrapNetRecv(childComms[c], &tag, sizeof(int)), res, out);
+    if (tag != BOOTSTRAP_PARENT_TAG(treeInfo->index)) {
+      // Rank which read stale info from the store, let it fetch it again
+      INFO(NCCL_INIT, "Bootstrap : rank %d rejected a child of tree index %d", rank, BOOTSTRAP_PARENT_TAG(tag));
+      bootstrapNetCloseRecv(childComms[c]);
+      nAccepted--;
+      c--;
+      continue;
+    }
+    NCCLCHECKGOTO(bootstrapNetSend(childComms[c], &tag, sizeof(int)), res, out);
+    NCCLCHECKGOTO(bootstrapNetRecv(childComms[c], &count, sizeof(int)), res, out);
+    if (count <= 0 || count > nranks-nHandles) {
+      WARN("Bootstrap : rank %d received %d handles from a child", rank, count);
+      res = ncclInternalError;
+      goto out;
+    }
+    NCCLCHECKGOTO(bootstrapNetRecv(childComms[c], handles+nHandles, count*sizeof(struct extRankHandle)), res, out);
+    nHandles += count;
+  }
+
+  NCCLCHECKGOTO(ncclCalloc(&state->peerBstrapHandles, nranks), res, out);
+  NCCLCHECKGOTO(ncclCalloc(&hostHashes, nranks), res, out);
+  if (treeInfo->index > 0) {
+    NCCLCHECKGOTO(bootstrapConnectParent(state, treeInfo, store, storeComm, storeId, &tmpSendComm), res, out);
+    NCCLCHECKGOTO(bootstrapNetSend(tmpSendComm, &nHandles, sizeof(int)), res, out);
+    NCCLCHECKGOTO(bootstrapNetSend(tmpSendComm, handles, nHandles*sizeof(struct extRankHandle)), res, out);
+    NCCLCHECKGOTO(bootstrapNetRecv(tmpSendComm, state->peerBstrapHandles, nranks*sizeof(ncclNetHandle_t)), res, out);
+    NCCLCHECKGOTO(bootstrapNetRecv(tmpSendComm, hostHashes, nranks*sizeof(uint64_t)), res, out);
+  } else {
+    NCCLCHECKGOTO(ncclCalloc(&found, nranks), res, out);
+    for (int h=0; h<nHandles; h++) {
+      int r = handles[h].rank;
+      if (r < 0 || r >= nranks || found[r]) {
+        WARN("Bootstrap : invalid or duplicate handle for rank %d", r);
+        res = ncclInternalError;
+        goto out;
+      }
+      found[r] = 1;
+      memcpy(state->peerBstrapHandles+r, handles[h].handle, sizeof(ncclNetHandle_t));
+      hostHashes[r] = handles[h].hostHash;
+    }
+    if (nHandles != nranks) {
+      WARN("Bootstrap : gathered %d handles instead of %d", nHandles, nranks);
+      res = ncclInternalError;
+      goto out;
+    }
+  }
+  for (int c=0; c<nChildren; c++) {
+    NCCLCHECKGOTO(bootstrapNetSend(childComms[c], state->peerBstrapHandles, nranks*sizeof(ncclNetHandle_t)), res, out);
+    NCCLCHECKGOTO(bootstrapNetSend(childComms[c], hostHashes, nranks*sizeof(uint64_t)), res, out);
+  }
+  NCCLCHECKGOTO(bootstrapSetNodes(state, hostHashes), res, out);
+
+out:
+  if (tmpSendComm) bootstrapNetCloseSend(tmpSendComm);
+  for (int c=0; c<nAccepted; c++) bootstrapNetCloseRecv(childComms[c]);
+  free(handles);
+  free(hostHashes);
+  free(found);
+  return res;
+}
+
 ncclResult_t bootstrapInit(ncclUniqueId * id, int rank, int nranks, void** commState) {
   ncclNetHandle_t* netHandle = (ncclNetHandle_t*) id;
-  bool idFromEnv = getenv("NCCL_COMM_ID") != NULL;
+  bool useStore = bootstrapIsStoreId(id);
+  bool idFromEnv = !useStore && getenv("NCCL_COMM_ID") != NULL;
   struct extState* state;
   NCCLCHECK(ncclCalloc(&state, 1));
   state->rank = rank;
@@ -278,6 +708,11 @@ ncclResult_t bootstrapInit(ncclUniqueId * id, int rank, int nranks, void** commS
   *commState = state;
 
   TRACE(NCCL_INIT, "rank %d nranks %d", rank, nranks);
+  double tStart = ncclTimeUs();
+  NCCLCHECK(ncclCalloc(&state->peerSendComms, nranks));
+  NCCLCHECK(ncclCalloc(&state->peerRecvComms, nranks));
+  NCCLCHECK(ncclCalloc(&state->recvPeers, nranks));
+  NCCLCHECK(ncclCalloc(&state->pfds, nranks+1));
 
   struct extInfo info = { 0 };
   info.rank = rank;
@@ -286,174 +721,531 @@ ncclResult_t bootstrapInit(ncclUniqueId * id, int rank, int nranks, void** commS
   // Pass the remote address to listen via info
   if (idFromEnv) {
     memcpy(&info.extHandleListen, netHandle, sizeof(ncclNetHandle_t));
-    memcpy(&info.extHandleListenRoot, netHandle, sizeof(ncclNetHandle_t));
   }
   // listen will return the local address via info (specify interface type 'findSubnetIf')
   state->dev = idFromEnv ? findSubnetIf : 0;
-  void* extBstrapListenCommRoot;
   NCCLCHECK(bootstrapNetListen(state->dev, &info.extHandleListen, &state->extBstrapListenComm));
-  NCCLCHECK(bootstrapNetListen(state->dev, &info.extHandleListenRoot, &extBstrapListenCommRoot));
-
-  // stagger connection times to avoid an overload of the root at very high rank counts
-  if (nranks > 128) {
-    long msec = rank;
-    struct timespec tv;
-    tv.tv_sec = msec / 1000;
-    tv.tv_nsec = 1000000 * (msec % 1000);
-    TRACE(NCCL_INIT, "rank %d delaying connection to root by %ld msec", rank, msec);
-    (void) nanosleep(&tv, NULL);
-  }
-
-  // send info on my listening socket to root
-  NCCLCHECK(bootstrapNetConnect(state->dev, netHandle, &tmpSendComm));
-  NCCLCHECK(bootstrapNetSend(tmpSendComm, &info, sizeof(info)));
-  NCCLCHECK(bootstrapNetCloseSend(tmpSendComm));
-
-  // get info on my "next" rank in the bootstrap ring from root
-  ncclNetHandle_t extHandleNext;
-  NCCLCHECK(bootstrapNetAccept(extBstrapListenCommRoot, &tmpRecvComm));
-  NCCLCHECK(bootstrapNetRecv(tmpRecvComm, &extHandleNext, sizeof(extHandleNext)));
-  NCCLCHECK(bootstrapNetCloseRecv(tmpRecvComm));
-  NCCLCHECK(bootstrapNetCloseListen(extBstrapListenCommRoot));
-
-  NCCLCHECK(bootstrapNetConnect(state->dev, &extHandleNext, &state->extBstrapRingSendComm));
-  // Accept the connect request from the previous rank in the AllGather ring
-  NCCLCHECK(bootstrapNetAccept(state->extBstrapListenComm, &state->extBstrapRingRecvComm));
-
-  // AllGather all listen handlers
-  NCCLCHECK(ncclCalloc(&state->peerBstrapHandles, nranks));
-  memcpy(state->peerBstrapHandles+rank, info.extHandleListen, sizeof(ncclNetHandle_t));
-  NCCLCHECK(bootstrapAllGather(state, state->peerBstrapHandles, sizeof(ncclNetHandle_t)));
+  // Listen for the ranks of my node now, in case I turn out to be their leader
+  void* localListenComm = NULL;
+  if (ncclParamBootstrapHierarchy()) NCCLCHECK(bootstrapLocalListen(&info.extHandleListen, &localListenComm));
+
+  // send info on my listening socket to root or to the store, which tells us where we are in the tree
+  struct extTreeInfo treeInfo;
+  ncclStore_t* store = NULL;
+  void* storeComm = NULL;
+  if (useStore) {
+    NCCLCHECK(ncclStoreOpen(&store, &storeComm));
+    NCCLCHECK(bootstrapStoreJoin(store, storeComm, (struct bootstrapStoreId*)id, &info, &treeInfo));
+  } else {
+    NCCLCHECK(bootstrapNetConnect(state->dev, netHandle, &tmpSendComm));
+    NCCLCHECK(bootstrapNetSend(tmpSendComm, &info, sizeof(info)));
+    NCCLCHECK(bootstrapNetRecv(tmpSendComm, &treeInfo, sizeof(treeInfo)));
+    NCCLCHECK(bootstrapNetCloseSend(tmpSendComm));
+  }
+  double tJoin = ncclTimeUs();
+
+  NCCLCHECK(bootstrapTreeExchange(state, &info, &treeInfo, store, storeComm, (struct bootstrapStoreId*)id));
+  double tTree = ncclTimeUs();
+
+  // my children fetched my info before connecting to me, so it can go
+  if (store) {
+    char key[NCCL_STORE_KEY_MAXSIZE];
+    bootstrapStoreKey((struct bootstrapStoreId*)id, rank, key);
+    NCCLCHECK(store->remove(storeComm, key));
+    NCCLCHECK(store->close(storeComm));
+  }
+
+  // connect to my node leader
+  if (state->localRanks > 1) NCCLCHECK(ncclCalloc(&state->localComms, state->localRanks));
+  if (state->localRank > 0) {
+    int leader = state->nodeRanks[state->nodeStart[state->node]];
+    NCCLCHECK(bootstrapNetCloseListen(localListenComm));
+    localListenComm = NULL;
+    NCCLCHECK(bootstrapLocalConnect(state->peerBstrapHandles+leader, state->localComms));
+    NCCLCHECK(bootstrapNetSend(state->localComms[0], &state->localRank, sizeof(int)));
+  }
+
+  // leaders connect to the leaders they send to during AllGather
+  int nNodes = state->nNodes;
+  state->nPeers = state->localRank == 0 && nNodes > 1 ? bootstrapNumPeers(nNodes) : 0;
+  for (int k=0; k<state->nPeers; k++) {
+    int peer = state->nodeRanks[state->nodeStart[(state->node + nNodes - (1 << k)) % nNodes]];
+    NCCLCHECK(bootstrapNetConnect(state->dev, state->peerBstrapHandles+peer, state->extBstrapSendComms+k));
+    NCCLCHECK(bootstrapNetSend(state->extBstrapSendComms[k], &k, sizeof(int)));
+  }
+  // Accept the connect requests of the ranks sending to me, which tell us
+  // which step they are for
+  for (int i=0; i<state->nPeers; i++) {
+    int k;
+    NCCLCHECK(bootstrapNetAccept(state->extBstrapListenComm, &tmpRecvComm));
+    NCCLCHECK(bootstrapNetRecv(tmpRecvComm, &k, sizeof(int)));
+    if (k < 0 || k >= state->nPeers || state->extBstrapRecvComms[k] != NULL) {
+      WARN("Bootstrap : rank %d received an invalid AllGather connection for step %d", rank, k);
+      bootstrapNetCloseRecv(tmpRecvComm);
+      return ncclInternalError;
+    }
+    state->extBstrapRecvComms[k] = tmpRecvComm;
+  }
+
+  // and accept the connections of their local ranks, which tell us their local rank
+  for (int i=1; state->localRank == 0 && i<state->localRanks; i++) {
+    int localRank;
+    NCCLCHECK(bootstrapNetAccept(localListenComm, &tmpRecvComm));
+    NCCLCHECK(bootstrapNetRecv(tmpRecvComm, &localRank, sizeof(int)));
+    if (localRank <= 0 || localRank >= state->localRanks || state->localComms[localRank] != NULL) {
+      WARN("Bootstrap : rank %d received an invalid connection from local rank %d", rank, localRank);
+      bootstrapNetCloseRecv(tmpRecvComm);
+      return ncclInternalError;
+    }
+    state->localComms[localRank] = tmpRecvComm;
+  }
+  if (localListenComm) NCCLCHECK(bootstrapNetCloseListen(localListenComm));
 
+  double tEnd = ncclTimeUs();
+  INFO(NCCL_INIT, "Bootstrap : rank %d init %.2f ms : %s %.2f, tree %.2f, connect %.2f", rank, (tEnd-tStart)*1e-3,
+      store ? "store" : "root", (tJoin-tStart)*1e-3, (tTree-tJoin)*1e-3, (tEnd-tTree)*1e-3);
   TRACE(NCCL_INIT, "rank %d nranks %d - DONE", rank, nranks);
 
   return ncclSuccess;
 }
 
+/* bootstrapInitAsync runs bootstrapInit in a thread, so that the caller can
+ * do its local setup meanwhile. bootstrapInitWait joins it.
+ */
+struct bootstrapInitArgs {
+  ncclUniqueId id;
+  int rank;
+  int nranks;
+  void* state;
+  ncclResult_t ret;
+  pthread_t thread;
+};
+
+static void* bootstrapInitThread(void* opaqueArgs) {
+  struct bootstrapInitArgs* args = (struct bootstrapInitArgs*)opaqueArgs;
+  args->ret = bootstrapInit(&args->id, args->rank, args->nranks, &args->state);
+  return NULL;
+}
+
+ncclResult_t bootstrapInitAsync(ncclUniqueId* id, int rank, int nranks, void** pendingInit) {
+  struct bootstrapInitArgs* args;
+  NCCLCHECK(ncclCalloc(&args, 1));
+  memcpy(&args->id, id, sizeof(ncclUniqueId));
+  args->rank = rank;
+  args->nranks = nranks;
+  int err = pthread_create(&args->thread, NULL, bootstrapInitThread, args);
+  if (err != 0) {
+    WARN("Bootstrap : could not create init thread : %s", strerror(err));
+    free(args);
+    return ncclSystemError;
+  }
+  *pendingInit = args;
+  return ncclSuccess;
+}
+
+// commState is set even if init failed, so that it can be aborted
+ncclResult_t bootstrapInitWait(void* pendingInit, void** commState) {
+  struct bootstrapInitArgs* args = (struct bootstrapInitArgs*)pendingInit;
+  pthread_join(args->thread, NULL);
+  ncclResult_t ret = args->ret;
+  *commState = args->state;
+  free(args);
+  return ret;
+}
+
+// Send count node blocks from sendNode to the leader of node-2^k while
+// receiving count node blocks from node+2^k into recvNode. Node n has slices
+// start[n] to start[n+1]-1, or only slice n if start is NULL. Blocks wrap
+// around the end of the buffer, so a range may take two messages.
+static ncclResult_t bootstrapExchange(struct extState* state, int k, char* data, int size, int* start, int sendNode, int recvNode, int count) {
+  int nNodes = state->nNodes;
+#define NODE_START(n) (start ? start[n] : (n))
+  sendNode %= nNodes;
+  recvNode %= nNodes;
+  int sendEnd = std::min(sendNode+count, nNodes);
+  int recvEnd = std::min(recvNode+count, nNodes);
+  // Number of slices before and after the wrap
+  int sendCount = NODE_START(sendEnd)-NODE_START(sendNode);
+  int recvCount = NODE_START(recvEnd)-NODE_START(recvNode);
+  int sendWrap = NODE_START(count-(sendEnd-sendNode));
+  int recvWrap = NODE_START(count-(recvEnd-recvNode));
+  NCCLCHECK(bootstrapNetSendRecv(state->extBstrapSendComms[k], data+(size_t)NODE_START(sendNode)*size, sendCount*size,
+        state->extBstrapRecvComms[k], data+(size_t)NODE_START(recvNode)*size, recvCount*size));
+#undef NODE_START
+  if (sendWrap || recvWrap) {
+    NCCLCHECK(bootstrapNetSendRecv(sendWrap ? state->extBstrapSendComms[k] : NULL, data, sendWrap*size,
+          recvWrap ? state->extBstrapRecvComms[k] : NULL, data, recvWrap*size));
+  }
+  return ncclSuccess;
+}
+
+// AllGather of node blocks between leaders
+static ncclResult_t bootstrapNodeAllGather(struct extState* state, char* blocks, int size, int* start) {
+  int node = state->node;
+  if (state->nPeers == 1) {
+    /* Simple ring based AllGather
+     * At each step i receive data from (node+i+1) from the right
+     * and send previous step's data from (node+i) to the left
+     */
+    for (int i=0; i<state->nNodes-1; i++) NCCLCHECK(bootstrapExchange(state, 0, blocks, size, start, node+i, node+i+1, 1));
+  } else {
+    /* Bruck AllGather
+     * Before step k we have the 2^k blocks from node on. Send them to
+     * (node-2^k), which misses them, and receive the next ones from (node+2^k).
+     */
+    for (int k=0, have=1; have<state->nNodes; k++) {
+      int count = std::min(have, state->nNodes-have);
+      NCCLCHECK(bootstrapExchange(state, k, blocks, size, start, node, node+have, count));
+      have += count;
+    }
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t bootstrapAllGather(void* commState, void* allData, int size) {
   struct extState* state = (struct extState*)commState;
   char* data = (char*)allData;
   int rank = state->rank;
   int nranks = state->nranks;
+  int* localNodeRanks = state->nodeRanks+state->nodeStart[state->node];
 
   TRACE(NCCL_INIT, "rank %d nranks %d size %d", rank, nranks, size);
 
-  /* Simple ring based AllGather
-   * At each step i receive data from (rank-i-1) from left
-   * and send previous step's data from (rank-i) to right
-   */
-  for (int i=0; i<nranks-1; i++) {
-    size_t rslice = (rank - i - 1 + nranks) % nranks;
-    size_t sslice = (rank - i + nranks) % nranks;
+  if (state->localRank > 0) {
+    // Leave it to my leader
+    NCCLCHECK(bootstrapNetSend(state->localComms[0], data+(size_t)rank*size, size));
+    NCCLCHECK(bootstrapNetRecv(state->localComms[0], data, nranks*size));
+    TRACE(NCCL_INIT, "rank %d nranks %d size %d - DONE", rank, nranks, size);
+    return ncclSuccess;
+  }
+
+  for (int i=1; i<state->localRanks; i++) {
+    NCCLCHECK(bootstrapNetRecv(state->localComms[i], data+(size_t)localNodeRanks[i]*size, size));
+  }
+
+  if (state->nNodes > 1) {
+    // Leaders exchange node blocks, which hold the slices of nodeRanks in
+    // order. With one rank per node, these are the slices of data.
+    char* blocks = data;
+    if (state->nNodes < nranks) {
+      NCCLCHECK(ncclCalloc(&blocks, (size_t)nranks*size));
+      for (int i=0; i<state->localRanks; i++) {
+        memcpy(blocks+(size_t)(state->nodeStart[state->node]+i)*size, data+(size_t)localNodeRanks[i]*size, size);
+      }
+    }
+    NCCLCHECK(bootstrapNodeAllGather(state, blocks, size, state->nodeStart));
+    if (blocks != data) {
+      for (int i=0; i<nranks; i++) memcpy(data+(size_t)state->nodeRanks[i]*size, blocks+(size_t)i*size, size);
+      free(blocks);
+    }
+  }
 
-    // Send slice to the right
-    NCCLCHECK(bootstrapNetSend(state->extBstrapRingSendComm, data+sslice*size, size));
-    // Recv slice from the left
-    NCCLCHECK(bootstrapNetRecv(state->extBstrapRingRecvComm, data+rslice*size, size));
+  for (int i=1; i<state->localRanks; i++) {
+    NCCLCHECK(bootstrapNetSend(state->localComms[i], data, nranks*size));
   }
 
   TRACE(NCCL_INIT, "rank %d nranks %d size %d - DONE", rank, nranks, size);
   return ncclSuccess;
 }
 
-ncclResult_t bootstrapSend(void* commState, int peer, void* data, int size) {
+static void bootstrapReduce(int* acc, int* values, int count, ncclRedOp_t op) {
+  for (int i=0; i<count; i++) {
+    switch (op) {
+      case ncclSum: acc[i] += values[i]; break;
+      case ncclProd: acc[i] *= values[i]; break;
+      case ncclMax: acc[i] = std::max(acc[i], values[i]); break;
+      case ncclMin: acc[i] = std::min(acc[i], values[i]); break;
+      default: break;
+    }
+  }
+}
+
+/* AllReduce of a few ints, in two levels like AllGather. Leaders reduce the
+ * values of their node, then gather the partial results of all nodes with
+ * the Bruck algorithm, which only takes log2(nNodes) small messages, and
+ * reduce them.
+ */
+ncclResult_t bootstrapAllReduce(void* commState, int* values, int count, ncclRedOp_t op) {
   struct extState* state = (struct extState*)commState;
-  void* tmpSendComm;
-  NCCLCHECK(bootstrapNetConnect(state->dev, state->peerBstrapHandles+peer, &tmpSendComm));
-  NCCLCHECK(bootstrapNetSend(tmpSendComm, &state->rank, sizeof(int)));
-  NCCLCHECK(bootstrapNetSend(tmpSendComm, data, size));
-  NCCLCHECK(bootstrapNetCloseSend(tmpSendComm));
+  int size = count*sizeof(int);
+  if (op != ncclSum && op != ncclProd && op != ncclMax && op != ncclMin) {
+    WARN("Bootstrap : unsupported reduction %d", op);
+    return ncclInvalidArgument;
+  }
+
+  if (state->localRank > 0) {
+    NCCLCHECK(bootstrapNetSend(state->localComms[0], values, size));
+    NCCLCHECK(bootstrapNetRecv(state->localComms[0], values, size));
+    return ncclSuccess;
+  }
+
+  int* tmp;
+  NCCLCHECK(ncclCalloc(&tmp, (size_t)count*std::max(state->nNodes, 2)));
+  for (int i=1; i<state->localRanks; i++) {
+    NCCLCHECK(bootstrapNetRecv(state->localComms[i], tmp, size));
+    bootstrapReduce(values, tmp, count, op);
+  }
+  if (state->nNodes > 1) {
+    memcpy(tmp+(size_t)state->node*count, values, size);
+    NCCLCHECK(bootstrapNodeAllGather(state, (char*)tmp, size, NULL));
+    // Reduce in node order, so that all ranks get the same result
+    memcpy(values, tmp, size);
+    for (int n=1; n<state->nNodes; n++) bootstrapReduce(values, tmp+(size_t)n*count, count, op);
+  }
+  free(tmp);
+  for (int i=1; i<state->localRanks; i++) {
+    NCCLCHECK(bootstrapNetSend(state->localComms[i], values, size));
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t bootstrapBarrier(void* commState) {
+  int dummy = 0;
+  NCCLCHECK(bootstrapAllReduce(commState, &dummy, 1, ncclMax));
   return ncclSuccess;
 }
 
-ncclResult_t unexpectedEnqueue(struct extState* state, int peer, void* comm) {
+/* Broadcast from root : the root hands its data to its leader, leaders pass
+ * it along a binomial tree over nodes, then to their local ranks. Counting
+ * nodes down from the root node, at step k nodes below 2^k send to the node
+ * 2^k further, which is the leader of node-2^k we have a connection to.
+ */
+ncclResult_t bootstrapBcast(void* commState, int root, void* data, int size) {
+  struct extState* state = (struct extState*)commState;
+  int rank = state->rank;
+  int nNodes = state->nNodes;
+  int* localNodeRanks = state->nodeRanks+state->nodeStart[state->node];
+  // Local rank of root if it is on my node, -1 otherwise
+  int localRoot = -1;
+  for (int i=0; i<state->localRanks; i++) if (localNodeRanks[i] == root) localRoot = i;
+
+  if (state->localRank > 0) {
+    if (rank == root) {
+      NCCLCHECK(bootstrapNetSend(state->localComms[0], data, size));
+    } else {
+      NCCLCHECK(bootstrapNetRecv(state->localComms[0], data, size));
+    }
+    return ncclSuccess;
+  }
+
+  if (localRoot > 0) NCCLCHECK(bootstrapNetRecv(state->localComms[localRoot], data, size));
+  if (nNodes > 1) {
+    int rootNode = 0;
+    for (int n=0; n<nNodes; n++) {
+      for (int i=state->nodeStart[n]; i<state->nodeStart[n+1]; i++) if (state->nodeRanks[i] == root) rootNode = n;
+    }
+    int v = (rootNode - state->node + nNodes) % nNodes;
+    if (state->nPeers == 1) {
+      // Ring : pass it on to node-1
+      if (v > 0) NCCLCHECK(bootstrapNetSendRecv(NULL, NULL, 0, state->extBstrapRecvComms[0], data, size));
+      if (v < nNodes-1) NCCLCHECK(bootstrapNetSendRecv(state->extBstrapSendComms[0], data, size, NULL, NULL, 0));
+    } else {
+      for (int k=0; (1 << k) < nNodes; k++) {
+        if (v < (1 << k) && v + (1 << k) < nNodes) {
+          NCCLCHECK(bootstrapNetSendRecv(state->extBstrapSendComms[k], data, size, NULL, NULL, 0));
+        } else if (v >= (1 << k) && v < (2 << k)) {
+          NCCLCHECK(bootstrapNetSendRecv(NULL, NULL, 0, state->extBstrapRecvComms[k], data, size));
+        }
+      }
+    }
+  }
+  for (int i=1; i<state->localRanks; i++) {
+    if (i != localRoot) NCCLCHECK(bootstrapNetSend(state->localComms[i], data, size));
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t bootstrapSend(void* commState, int peer, int tag, void* data, int size) {
+  struct extState* state = (struct extState*)commState;
+  if (state->peerSendComms[peer] == NULL) {
+    NCCLCHECK(bootstrapNetConnect(state->dev, state->peerBstrapHandles+peer, state->peerSendComms+peer));
+    NCCLCHECK(bootstrapNetSend(state->peerSendComms[peer], &state->rank, sizeof(int)));
+  }
+  struct bootstrapNetComm* comm = (struct bootstrapNetComm*)state->peerSendComms[peer];
+  struct msgHeader hdr = { tag, size };
+  NCCLCHECK(socketSend(comm->fd, &hdr, sizeof(hdr)));
+  NCCLCHECK(socketSend(comm->fd, data, size));
+  return ncclSuccess;
+}
+
+static int unexpectedHash(int peer, int tag) {
+  return ((unsigned)peer * 2654435761U + (unsigned)tag) % UNEX_HASH_SIZE;
+}
+
+static ncclResult_t unexpectedEnqueue(struct extState* state, int peer, int tag, char* data, int size) {
   // New unex
-  struct unexConn* unex;
+  struct unexMsg* unex;
   NCCLCHECK(ncclCalloc(&unex, 1));
   unex->peer = peer;
-  unex->comm = comm;
+  unex->tag = tag;
+  unex->data = data;
+  unex->size = size;
 
-  // Enqueue
-  struct unexConn* list = state->unexpectedConnections;
-  if (list == NULL) {
-    state->unexpectedConnections = unex;
-    return ncclSuccess;
-  }
-  while (list->next) list = list->next;
-  list->next = unex;
+  // Enqueue at the end of its bucket, to keep messages in order
+  struct unexMsg** list = state->unexpectedMessages+unexpectedHash(peer, tag);
+  while (*list) list = &(*list)->next;
+  *list = unex;
+  state->nUnexpected++;
   return ncclSuccess;
 }
 
-void* unexpectedDequeue(struct extState* state, int peer) {
-  struct unexConn* elem = state->unexpectedConnections;
-  struct unexConn* prev = NULL;
-  while (elem) {
-    if (elem->peer == peer) {
-      if (prev == NULL) {
-        state->unexpectedConnections = elem->next;
-      } else {
-        prev->next = elem->next;
-      }
-      void* comm = elem->comm;
-      free(elem);
-      return comm;
+static struct unexMsg* unexpectedDequeue(struct extState* state, int peer, int tag) {
+  struct unexMsg** list = state->unexpectedMessages+unexpectedHash(peer, tag);
+  for (; *list; list = &(*list)->next) {
+    struct unexMsg* elem = *list;
+    if (elem->peer == peer && elem->tag == tag) {
+      *list = elem->next;
+      state->nUnexpected--;
+      return elem;
     }
-    prev = elem;
-    elem = elem->next;
   }
   return NULL;
 }
 
+// Receive the next message from peer. Store it in data if it has the tag we
+// are waiting for, queue it otherwise. data is NULL if we are waiting for
+// another peer. closed is set if the peer closed the connection instead.
+static ncclResult_t bootstrapRecvMessage(struct extState* state, int peer, int tag, void* data, int size, int* found, int* closed) {
+  struct bootstrapNetComm* comm = (struct bootstrapNetComm*)state->peerRecvComms[peer];
+  struct msgHeader hdr;
+  int bytes;
+  SYSCHECKSYNC(recv(comm->fd, &hdr, sizeof(hdr), MSG_PEEK), "recv", bytes);
+  if (bytes == -1) {
+    WARN("Call to recv failed : %s", strerror(errno));
+    return ncclSystemError;
+  }
+  *closed = bytes == 0;
+  if (*closed) return ncclSuccess;
+  NCCLCHECK(socketReceive(comm->fd, &hdr, sizeof(hdr)));
+  if (data && hdr.tag == tag && *found == 0) {
+    if (hdr.size > size) {
+      WARN("Message truncated : received %d bytes instead of %d\n", hdr.size, size);
+      return ncclInternalError;
+    }
+    NCCLCHECK(socketReceive(comm->fd, data, hdr.size));
+    *found = 1;
+    return ncclSuccess;
+  }
+  char* unexData = NULL;
+  if (hdr.size > 0) {
+    NCCLCHECK(ncclCalloc(&unexData, hdr.size));
+    NCCLCHECK(socketReceive(comm->fd, unexData, hdr.size));
+  }
+  NCCLCHECK(unexpectedEnqueue(state, peer, hdr.tag, unexData, hdr.size));
+  return ncclSuccess;
+}
+
 // We can't know who we'll receive from, so we need to receive everything at once
-ncclResult_t bootstrapRecv(void* commState, int peer, void* data, int size) {
+ncclResult_t bootstrapRecv(void* commState, int peer, int tag, void* data, int size) {
   struct extState* state = (struct extState*)commState;
 
-  void* tmpRecvComm;
-
-  // Search unexpected connections first
-  if ((tmpRecvComm = unexpectedDequeue(state, peer)) != NULL) {
-    NCCLCHECK(bootstrapNetRecv(tmpRecvComm, ((char*)data), size));
-    NCCLCHECK(bootstrapNetCloseRecv(tmpRecvComm));
+  // Search unexpected messages first
+  struct unexMsg* unex = unexpectedDequeue(state, peer, tag);
+  if (unex != NULL) {
+    if (unex->size > size) {
+      WARN("Message truncated : received %d bytes instead of %d\n", unex->size, size);
+      return ncclInternalError;
+    }
+    memcpy(data, unex->data, unex->size);
+    free(unex->data);
+    free(unex);
     return ncclSuccess;
   }
 
-  // Then look for new connections
-  while (1) {
-    NCCLCHECK(bootstrapNetAccept(state->extBstrapListenComm, &tmpRecvComm));
-    int newPeer;
-    NCCLCHECK(bootstrapNetRecv(tmpRecvComm, &newPeer, sizeof(int)));
-    if (newPeer == peer) {
-      NCCLCHECK(bootstrapNetRecv(tmpRecvComm, ((char*)data), size));
-      NCCLCHECK(bootstrapNetCloseRecv(tmpRecvComm));
-      return ncclSuccess;
+  // Then wait for new connections and messages
+  struct bootstrapNetComm* lComm = (struct bootstrapNetComm*)state->extBstrapListenComm;
+  struct pollfd* pfds = state->pfds;
+  int found = 0;
+  while (found == 0) {
+    int nfds = state->nRecvPeers+1;
+    pfds[0].fd = lComm->fd;
+    pfds[0].events = POLLIN;
+    for (int p=0; p<state->nRecvPeers; p++) {
+      pfds[p+1].fd = ((struct bootstrapNetComm*)state->peerRecvComms[state->recvPeers[p]])->fd;
+      pfds[p+1].events = POLLIN;
+    }
+    int ret;
+    SYSCHECKSYNC(poll(pfds, nfds, -1), "poll", ret);
+    if (ret == -1) {
+      WARN("Call to poll failed : %s", strerror(errno));
+      return ncclSystemError;
+    }
+    // Go backwards, so that peers we remove are replaced by ones we already checked
+    for (int p=nfds-2; p>=0; p--) {
+      if (pfds[p+1].revents == 0) continue;
+      int recvPeer = state->recvPeers[p], closed;
+      NCCLCHECK(bootstrapRecvMessage(state, recvPeer, tag, recvPeer == peer ? data : NULL, size, &found, &closed));
+      if (closed) {
+        if (recvPeer == peer && found == 0) {
+          WARN("Bootstrap : rank %d closed its connection", peer);
+          return ncclSystemError;
+        }
+        NCCLCHECK(bootstrapNetCloseRecv(state->peerRecvComms[recvPeer]));
+        state->peerRecvComms[recvPeer] = NULL;
+        state->recvPeers[p] = state->recvPeers[--state->nRecvPeers];
+      }
+    }
+    if (pfds[0].revents) {
+      void* tmpRecvComm;
+      int newPeer;
+      NCCLCHECK(bootstrapNetAccept(state->extBstrapListenComm, &tmpRecvComm));
+      NCCLCHECK(bootstrapNetRecv(tmpRecvComm, &newPeer, sizeof(int)));
+      if (newPeer < 0 || newPeer >= state->nranks || state->peerRecvComms[newPeer] != NULL) {
+        WARN("Bootstrap : unexpected connection from rank %d", newPeer);
+        bootstrapNetCloseRecv(tmpRecvComm);
+        return ncclInternalError;
+      }
+      state->peerRecvComms[newPeer] = tmpRecvComm;
+      state->recvPeers[state->nRecvPeers++] = newPeer;
     }
-    // Unexpected connection. Save for later.
-    NCCLCHECK(unexpectedEnqueue(state, newPeer, tmpRecvComm));
   }
+  return ncclSuccess;
 }
 
-ncclResult_t bootstrapClose(void* commState) {
-  struct extState* state = (struct extState*)commState;
-  if (state->unexpectedConnections != NULL) {
-    WARN("Unexpected connections are not empty.\n");
-    return ncclInternalError;
+static void bootstrapClosePeers(struct extState* state) {
+  bootstrapNetCloseListen(state->extBstrapListenComm);
+  for (int k=0; k<state->nPeers; k++) {
+    bootstrapNetCloseSend(state->extBstrapSendComms[k]);
+    bootstrapNetCloseRecv(state->extBstrapRecvComms[k]);
   }
-  NCCLCHECK(bootstrapNetCloseListen(state->extBstrapListenComm));
-  NCCLCHECK(bootstrapNetCloseSend(state->extBstrapRingSendComm));
-  NCCLCHECK(bootstrapNetCloseRecv(state->extBstrapRingRecvComm));
-
+  for (int r=0; r<state->nranks; r++) {
+    if (state->peerSendComms) bootstrapNetCloseSend(state->peerSendComms[r]);
+    if (state->peerRecvComms) bootstrapNetCloseRecv(state->peerRecvComms[r]);
+  }
+  if (state->localComms) {
+    for (int i=0; i<state->localRanks; i++) bootstrapNetClose(state->localComms[i]);
+  }
+  for (int h=0; h<UNEX_HASH_SIZE; h++) {
+    while (state->unexpectedMessages[h]) {
+      struct unexMsg* unex = state->unexpectedMessages[h];
+      state->unexpectedMessages[h] = unex->next;
+      free(unex->data);
+      free(unex);
+    }
+  }
+  free(state->peerSendComms);
+  free(state->peerRecvComms);
+  free(state->recvPeers);
+  free(state->pfds);
   free(state->peerBstrapHandles);
+  free(state->localComms);
+  free(state->nodeRanks);
+  free(state->nodeStart);
   free(state);
+}
 
+ncclResult_t bootstrapClose(void* commState) {
+  struct extState* state = (struct extState*)commState;
+  if (state->nUnexpected != 0) {
+    WARN("Unexpected messages are not empty.\n");
+    return ncclInternalError;
+  }
+  bootstrapClosePeers(state);
   return ncclSuccess;
 }
 
 ncclResult_t bootstrapAbort(void* commState) {
   struct extState* state = (struct extState*)commState;
-  bootstrapNetCloseListen(state->extBstrapListenComm);
-  bootstrapNetCloseSend(state->extBstrapRingSendComm);
-  bootstrapNetCloseRecv(state->extBstrapRingRecvComm);
-  free(state->peerBstrapHandles);
-  free(state);
+  bootstrapClosePeers(state);
   return ncclSuccess;
 }
@@ -583,6 +583,31 @@ ncclResult_t ncclTopoCpuType(struct ncclTopoSystem* system, int* arch, int* vend
 
 NCCL_PARAM(IgnoreCpuAffinity, "IGNORE_CPU_AFFINITY", 0);
 
+// Get the NUMA node and affinity of the CPU closest to a NIC. Leaves them
+// at -1 and empty if the NIC is not part of the topology.
+ncclResult_t ncclTopoGetNetAffinity(struct ncclTopoSystem* system, int netDev, int* numaId, cpu_set_t* affinity) {
+  *numaId = -1;
+  CPU_ZERO(affinity);
+  int n;
+  NCCLCHECK(ncclTopoIdToIndex(system, NET, netDev, &n));
+  if (n == -1) return ncclSuccess;
+  struct ncclTopoNode* net = system->nodes[NET].nodes+n;
+  if (net->paths[CPU] == NULL) return ncclSuccess;
+  int cpuIndex = -1, minHops = 0;
+  for (int c=0; c<system->nodes[CPU].count; c++) {
+    int nHops = net->paths[CPU][c].count;
+    if (cpuIndex == -1 || nHops < minHops) {
+      cpuIndex = c;
+      minHops = nHops;
+    }
+  }
+  if (cpuIndex != -1) {
+    *numaId = system->nodes[CPU].nodes[cpuIndex].id;
+    *affinity = system->nodes[CPU].nodes[cpuIndex].cpu.affinity;
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclTopoSetAffinity(struct ncclTopoSystem* system, int rank) {
   struct ncclTopoNode* cpu = NULL, *gpu = NULL;
   for (int g=0; g<system->nodes[GPU].count; g++) {
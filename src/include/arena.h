@@ -0,0 +1,46 @@
+/*************************************************************************
+ * Copyright (c) 2020, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_ARENA_H_
+#define NCCL_ARENA_H_
+
+#include "nccl.h"
+#include <stddef.h>
+
+/* Arenas hand out zeroed, cache-line aligned blocks carved out of large
+ * chunks, placed on a given NUMA node. Blocks are never freed one by one :
+ * everything goes back to the system at once when the arena is released.
+ * An arena is not thread-safe ; it is meant to be used by the thread which
+ * owns the communicator.
+ */
+struct ncclArenaChunk;
+struct ncclArena {
+  char name[32];
+  int numaId;  // -1 : no placement
+  int bound;   // 1 if chunks could be bound to numaId
+  struct ncclArenaChunk* chunks;
+  char* cur;
+  size_t left;
+  // Statistics, reported when the arena is released
+  int nChunks;
+  size_t mapped;  // Bytes obtained from the system
+  size_t used;    // Bytes handed out, i.e. high-water mark
+};
+
+void ncclArenaInit(struct ncclArena* arena, const char* name, int numaId);
+ncclResult_t ncclArenaAlloc(struct ncclArena* arena, size_t size, void** ptr);
+ncclResult_t ncclArenaRelease(struct ncclArena* arena);
+
+template <typename T>
+static ncclResult_t ncclArenaCalloc(struct ncclArena* arena, T** ptr, size_t nelem) {
+  void* p;
+  ncclResult_t ret = ncclArenaAlloc(arena, nelem*sizeof(T), &p);
+  if (ret != ncclSuccess) return ret;
+  *ptr = (T*)p;
+  return ncclSuccess;
+}
+
+#endif
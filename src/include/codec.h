@@ -0,0 +1,235 @@
+/*************************************************************************
+ * Copyright (c) 2020, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_CODEC_H_
+#define NCCL_CODEC_H_
+
+// Lossless codecs used to shrink host-staged network traffic
+
+#include "core.h"
+#include <string.h>
+
+struct ncclCodec {
+  const char* name;
+  // Encode size bytes from src into at most dstSize bytes. Returns the
+  // encoded size, or 0 if the data does not fit.
+  int (*encode)(const char* src, int size, char* dst, int dstSize);
+  // Decode size bytes from src, which must give exactly dstSize bytes
+  ncclResult_t (*decode)(const char* src, int size, char* dst, int dstSize);
+};
+
+/* LZ codec : a byte-oriented LZ77 in the spirit of LZ4. The input is a
+ * sequence of (literals, match) pairs. Each starts with a token byte whose
+ * high nibble is the number of literals and low nibble the match length
+ * minus 4 ; a nibble of 15 is followed by extra length bytes, adding up to
+ * 255 each until a byte below 255. Literals come next, then the match
+ * offset on 2 bytes, little endian, then the extra match length bytes.
+ * The last pair has no match : it ends with the input.
+ */
+#define NCCL_LZ_HASH_LOG 12
+#define NCCL_LZ_MIN_MATCH 4
+#define NCCL_LZ_MAX_OFFSET 65535
+
+static inline uint32_t ncclLzRead32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(uint32_t));
+  return v;
+}
+
+static inline uint64_t ncclLzRead64(const uint8_t* p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(uint64_t));
+  return v;
+}
+
+static inline uint8_t* ncclLzPutLength(uint8_t* op, int len) {
+  for (; len >= 255; len -= 255) *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+static inline uint8_t* ncclLzPutSequence(uint8_t* op, const uint8_t* lit, int litLen, int offset, int matchLen) {
+  uint8_t* token = op++;
+  *token = (std::min(litLen, 15) << 4) | (offset ? std::min(matchLen-NCCL_LZ_MIN_MATCH, 15) : 0);
+  if (litLen >= 15) op = ncclLzPutLength(op, litLen-15);
+  memcpy(op, lit, litLen);
+  op += litLen;
+  if (offset == 0) return op;
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  if (matchLen-NCCL_LZ_MIN_MATCH >= 15) op = ncclLzPutLength(op, matchLen-NCCL_LZ_MIN_MATCH-15);
+  return op;
+}
+
+// Worst-case size of a sequence, used to stop before overflowing dst
+static inline int ncclLzSequenceBound(int litLen, int matchLen) {
+  return 1 + litLen/255+1 + litLen + 2 + matchLen/255+1;
+}
+
+static int ncclLzEncode(const char* src, int size, char* dst, int dstSize) {
+  const uint8_t* in = (const uint8_t*)src;
+  uint8_t* op = (uint8_t*)dst;
+  uint8_t* opEnd = op+dstSize;
+  int table[1 << NCCL_LZ_HASH_LOG];
+  memset(table, 0, sizeof(table));
+  int ip = 0, anchor = 0, misses = 0;
+  while (ip + 8 <= size) {
+    uint32_t seq = ncclLzRead32(in+ip);
+    uint32_t h = (seq * 2654435761U) >> (32-NCCL_LZ_HASH_LOG);
+    int ref = table[h];
+    table[h] = ip;
+    if (ref >= ip || ip-ref > NCCL_LZ_MAX_OFFSET || ncclLzRead32(in+ref) != seq) {
+      // Step faster through data which does not compress
+      ip += 1 + (misses++ >> 6);
+      continue;
+    }
+    int len = NCCL_LZ_MIN_MATCH;
+    while (ip+len+8 <= size) {
+      uint64_t diff = ncclLzRead64(in+ip+len) ^ ncclLzRead64(in+ref+len);
+      if (diff) {
+        len += __builtin_ctzll(diff) >> 3;
+        goto matched;
+      }
+      len += 8;
+    }
+    while (ip+len < size && in[ip+len] == in[ref+len]) len++;
+matched:
+    if (op + ncclLzSequenceBound(ip-anchor, len) > opEnd) return 0;
+    op = ncclLzPutSequence(op, in+anchor, ip-anchor, ip-ref, len);
+    ip += len;
+    anchor = ip;
+    misses = 0;
+  }
+  if (op + ncclLzSequenceBound(size-anchor, 0) > opEnd) return 0;
+  op = ncclLzPutSequence(op, in+anchor, size-anchor, 0, 0);
+  return op-(uint8_t*)dst;
+}
+
+static inline ncclResult_t ncclLzGetLength(const uint8_t** ip, const uint8_t* ipEnd, int* len) {
+  uint8_t b;
+  do {
+    if (*ip == ipEnd) return ncclInternalError;
+    b = *(*ip)++;
+    *len += b;
+    if (*len < 0) return ncclInternalError;
+  } while (b == 255);
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclLzDecode(const char* src, int size, char* dst, int dstSize) {
+  const uint8_t* ip = (const uint8_t*)src;
+  const uint8_t* ipEnd = ip+size;
+  uint8_t* op = (uint8_t*)dst;
+  uint8_t* opEnd = op+dstSize;
+  while (ip < ipEnd) {
+    uint8_t token = *ip++;
+    int litLen = token >> 4;
+    if (litLen == 15 && ncclLzGetLength(&ip, ipEnd, &litLen) != ncclSuccess) goto corrupted;
+    if (litLen > ipEnd-ip || litLen > opEnd-op) goto corrupted;
+    memcpy(op, ip, litLen);
+    ip += litLen;
+    op += litLen;
+    if (ip == ipEnd) break;
+    if (ipEnd-ip < 2) goto corrupted;
+    int offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    int matchLen = token & 15;
+    if (matchLen == 15 && ncclLzGetLength(&ip, ipEnd, &matchLen) != ncclSuccess) goto corrupted;
+    matchLen += NCCL_LZ_MIN_MATCH;
+    if (offset == 0 || offset > op-(uint8_t*)dst || matchLen > opEnd-op) goto corrupted;
+    // Overlapping matches repeat the last offset bytes : copy what is
+    // already there, which doubles the pattern at each step
+    const uint8_t* ref = op-offset;
+    while (matchLen) {
+      int n = std::min(matchLen, (int)(op-ref));
+      memcpy(op, ref, n);
+      op += n;
+      matchLen -= n;
+    }
+  }
+  if (op == opEnd) return ncclSuccess;
+corrupted:
+  WARN("LZ codec : corrupted input of %d bytes", size);
+  return ncclInternalError;
+}
+
+/* Sparse codec : drops 32-bit words which are zero, which is cheaper than
+ * LZ on sparse gradients. Each group of 32 words is encoded as a 32-bit
+ * mask of its non-zero words followed by these words. Trailing bytes which
+ * do not fill a word are copied as is.
+ */
+#define NCCL_SPARSE_GROUP 32
+
+static int ncclSparseEncode(const char* src, int size, char* dst, int dstSize) {
+  int nWords = size/4;
+  char* op = dst;
+  char* opEnd = dst+dstSize;
+  for (int w=0; w<nWords; w+=NCCL_SPARSE_GROUP) {
+    int n = std::min(NCCL_SPARSE_GROUP, nWords-w);
+    if (opEnd-op < 4+4*n) return 0;
+    uint32_t mask = 0;
+    int k = 0;
+    for (int i=0; i<n; i++) {
+      uint32_t v;
+      memcpy(&v, src+4*(w+i), 4);
+      memcpy(op+4+4*k, &v, 4);
+      mask |= (uint32_t)(v != 0) << i;
+      k += v != 0;
+    }
+    memcpy(op, &mask, 4);
+    op += 4+4*k;
+  }
+  int tail = size-4*nWords;
+  if (opEnd-op < tail) return 0;
+  memcpy(op, src+4*nWords, tail);
+  return op+tail-dst;
+}
+
+static ncclResult_t ncclSparseDecode(const char* src, int size, char* dst, int dstSize) {
+  int nWords = dstSize/4;
+  const char* ip = src;
+  const char* ipEnd = src+size;
+  for (int w=0; w<nWords; w+=NCCL_SPARSE_GROUP) {
+    int n = std::min(NCCL_SPARSE_GROUP, nWords-w);
+    uint32_t mask;
+    if (ipEnd-ip < 4) goto corrupted;
+    memcpy(&mask, ip, 4);
+    ip += 4;
+    if ((n < 32 && (mask >> n)) || ipEnd-ip < 4*__builtin_popcount(mask)) goto corrupted;
+    memset(dst+4*w, 0, 4*n);
+    for (; mask; mask &= mask-1) {
+      memcpy(dst+4*(w+__builtin_ctz(mask)), ip, 4);
+      ip += 4;
+    }
+  }
+  if (ipEnd-ip != dstSize-4*nWords) goto corrupted;
+  memcpy(dst+4*nWords, ip, ipEnd-ip);
+  return ncclSuccess;
+corrupted:
+  WARN("Sparse codec : corrupted input of %d bytes", size);
+  return ncclInternalError;
+}
+
+// Index 0 means no codec
+#define NCCL_CODEC_NONE 0
+#define NCCL_CODEC_LZ 1
+#define NCCL_CODEC_SPARSE 2
+#define NCCL_NUM_CODECS 3
+static struct ncclCodec ncclCodecs[NCCL_NUM_CODECS] = {
+  { "none", NULL, NULL },
+  { "lz", ncclLzEncode, ncclLzDecode },
+  { "sparse", ncclSparseEncode, ncclSparseDecode }
+};
+
+// Returns the index of the codec with the given name, or -1
+static int ncclCodecByName(const char* name) {
+  for (int c=0; c<NCCL_NUM_CODECS; c++) {
+    if (strcasecmp(name, ncclCodecs[c].name) == 0) return c;
+  }
+  return -1;
+}
+
+#endif
@@ -128,9 +128,11 @@ struct ncclComm {
   struct ncclColl args;
   void* argsptr;
 
-  // Global proxy thread
-  pthread_t proxyThread;
-  struct ncclProxyState proxyState;
+  // Proxy states, each holding the network operations of a subset of the
+  // channels, and progressed by a proxy thread
+  int nProxyStates;
+  struct ncclProxyState proxyState[NCCL_PROXY_MAX_THREADS];
+  int channelProxy[MAXCHANNELS];
 
   // Whether this communicator uses collNet
   int collNetSupport;
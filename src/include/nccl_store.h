@@ -0,0 +1,40 @@
+/*************************************************************************
+ * Copyright (c) 2020, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_STORE_H_
+#define NCCL_STORE_H_
+
+#include "nccl.h"
+#include "nccl_net.h"
+
+// Keys are printable strings of up to NCCL_STORE_KEY_MAXSIZE bytes,
+// including the terminating NUL.
+#define NCCL_STORE_KEY_MAXSIZE 128
+
+typedef struct {
+  // Name of the store (mainly for logs)
+  const char* name;
+  // Initialize the store plugin.
+  ncclResult_t (*init)(ncclDebugLogger_t logFunction);
+  // Connect to the store. config is what follows "plugin:" in
+  // NCCL_BOOTSTRAP_STORE, or an empty string.
+  ncclResult_t (*open)(const char* config, void** store);
+  // Publish size bytes under key, replacing any previous value.
+  ncclResult_t (*set)(void* store, const char* key, const void* value, int size);
+  // Wait until key is published, then fetch its value, which must be
+  // exactly size bytes.
+  ncclResult_t (*get)(void* store, const char* key, void* value, int size);
+  // Remove key, if it exists.
+  ncclResult_t (*remove)(void* store, const char* key);
+  // Close and free the store object
+  ncclResult_t (*close)(void* store);
+} ncclStore_v1_t;
+
+typedef ncclStore_v1_t ncclStore_t;
+
+#define NCCL_STORE_PLUGIN_SYMBOL ncclStorePlugin_v1
+
+#endif // end include guard
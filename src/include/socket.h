@@ -14,6 +14,8 @@
 #include <netdb.h>
 #include <ifaddrs.h>
 #include <net/if.h>
+#include <fcntl.h>
+#include <poll.h>
 #include "utils.h"
 
 #define MAX_IFS 16
@@ -400,6 +402,106 @@ retry:
   return ncclSystemError;
 }
 
+static ncclResult_t connectStart(int* fd, union socketAddress* remoteAddr, int* err) {
+  int family = remoteAddr->sa.sa_family;
+  int salen = (family == AF_INET) ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+  *fd = socket(family, SOCK_STREAM, 0);
+  if (*fd == -1) {
+    WARN("Net : Socket creation failed : %s", strerror(errno));
+    return ncclSystemError;
+  }
+  const int one = 1;
+  SYSCHECK(setsockopt(*fd, IPPROTO_TCP, TCP_NODELAY, (char*)&one, sizeof(int)), "setsockopt");
+  SYSCHECK(fcntl(*fd, F_SETFL, O_NONBLOCK), "fcntl");
+  *err = connect(*fd, &remoteAddr->sa, salen) == 0 ? 0 : errno;
+  return ncclSuccess;
+}
+
+// Check the outcome of a connection attempt. Connections which should be
+// retried are closed and *fd is set to -1.
+static ncclResult_t connectCheck(int* fd, int err, union socketAddress* remoteAddr, int* refusedRetries, int* timedoutRetries) {
+  if (err == 0) {
+    SYSCHECK(fcntl(*fd, F_SETFL, 0), "fcntl");
+    return ncclSuccess;
+  }
+  close(*fd);
+  *fd = -1;
+  if ((err == ECONNREFUSED && ++(*refusedRetries) < RETRY_REFUSED_TIMES) ||
+      (err == ETIMEDOUT && ++(*timedoutRetries) < RETRY_TIMEDOUT_TIMES)) {
+    if (*refusedRetries % 1000 == 0) INFO(NCCL_ALL,"Call to connect returned %s, retrying", strerror(err));
+    return ncclSuccess;
+  }
+  char line[1024];
+  WARN("Connect to %s failed : %s", socketToString(&remoteAddr->sa, line), strerror(err));
+  return ncclSystemError;
+}
+
+/* Connect n sockets concurrently : connections are started in non-blocking
+ * mode and completed with poll, so that they cost one round trip instead
+ * of n. Refused or timed out connections are retried like in connectAddress.
+ */
+static ncclResult_t connectAddresses(int* fds, union socketAddress* remoteAddrs, int n) {
+  ncclResult_t ret = ncclSuccess;
+  struct pollfd* pfds = (struct pollfd*)malloc(n*sizeof(struct pollfd));
+  int* retries = (int*)calloc(2*n, sizeof(int)); // Refused and timed out retries of each connection
+  for (int i=0; i<n; i++) fds[i] = -1;
+  if (pfds == NULL || retries == NULL) {
+    WARN("Net : failed to allocate connection state");
+    ret = ncclSystemError;
+    goto end;
+  }
+  for (int i=0; i<n; i++) {
+    pfds[i].fd = -1;
+    pfds[i].events = POLLOUT;
+  }
+  for (int left = n; left; ) {
+    int inProgress = 0, retry = 0;
+    for (int i=0; i<n; i++) {
+      if (fds[i] != -1) {
+        if (pfds[i].fd != -1) inProgress++;
+        continue;
+      }
+      int err;
+      NCCLCHECKGOTO(connectStart(fds+i, remoteAddrs+i, &err), ret, end);
+      if (err == EINPROGRESS) {
+        pfds[i].fd = fds[i];
+        inProgress++;
+        continue;
+      }
+      NCCLCHECKGOTO(connectCheck(fds+i, err, remoteAddrs+i, retries+2*i, retries+2*i+1), ret, end);
+      if (fds[i] == -1) retry++; else left--;
+    }
+    if (inProgress == 0) {
+      if (retry) usleep(SLEEP_INT);
+      continue;
+    }
+    int nready;
+    SYSCHECKSYNC(poll(pfds, n, retry ? SLEEP_INT/1000 : -1), "poll", nready);
+    if (nready == -1) {
+      WARN("Net : poll failed : %s", strerror(errno));
+      ret = ncclSystemError;
+      goto end;
+    }
+    for (int i=0; i<n && nready; i++) {
+      if (pfds[i].fd == -1 || pfds[i].revents == 0) continue;
+      nready--;
+      int err;
+      socklen_t errlen = sizeof(int);
+      if (getsockopt(fds[i], SOL_SOCKET, SO_ERROR, &err, &errlen) != 0) err = errno;
+      pfds[i].fd = -1;
+      NCCLCHECKGOTO(connectCheck(fds+i, err, remoteAddrs+i, retries+2*i, retries+2*i+1), ret, end);
+      if (fds[i] != -1) left--;
+    }
+  }
+end:
+  if (ret != ncclSuccess) {
+    for (int i=0; i<n; i++) if (fds[i] != -1) { close(fds[i]); fds[i] = -1; }
+  }
+  free(pfds);
+  free(retries);
+  return ret;
+}
+
 #define NCCL_SOCKET_SEND 0
 #define NCCL_SOCKET_RECV 1
 static ncclResult_t socketProgressOpt(int op, int fd, void* ptr, int size, int* offset, int block) {
@@ -0,0 +1,23 @@
+/*************************************************************************
+ * Copyright (c) 2020, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_INT_STORE_H_
+#define NCCL_INT_STORE_H_
+
+#include "nccl.h"
+#include "nccl_store.h"
+
+/* Rendezvous stores let ranks publish and fetch their bootstrap handles
+ * instead of checking in with a root thread. NCCL_BOOTSTRAP_STORE selects
+ * one of :
+ *   file:<directory>   one file per key, in a directory shared by all ranks
+ *   tcp:<host>:<port>  key-value server, like the one in ext-store/tcp
+ *   plugin[:<config>]  ncclStorePlugin_v1 from libnccl-store.so
+ */
+bool ncclStoreEnabled();
+ncclResult_t ncclStoreOpen(ncclStore_t** store, void** storeComm);
+
+#endif
@@ -0,0 +1,56 @@
+/*************************************************************************
+ * Copyright (c) 2020, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_TRACE_H_
+#define NCCL_TRACE_H_
+
+#include "nccl.h"
+#include <stdint.h>
+
+/* Proxy timeline tracing (NCCL_PROXY_TRACE=N traces one op in N). Each proxy
+ * thread records the events of its ops in its own ring buffer, without
+ * locking, and writes them as Chrome trace JSON (chrome://tracing, Perfetto)
+ * when it exits or when the process gets SIGUSR2. Each communicator is a
+ * process of the trace, as shared proxy threads serve several of them.
+ */
+enum ncclProxyTraceType { ncclProxyTraceReady, ncclProxyTracePosted, ncclProxyTraceStep, ncclProxyTraceDone };
+
+struct ncclProxyTraceEvent {
+  double time;
+  uint64_t opCount;
+  uint64_t step;
+  int comm; // Trace id of the communicator
+  int rank;
+  int peer;
+  int16_t channel;
+  int8_t type;
+  int8_t send;
+  int8_t protocol;
+};
+
+struct ncclProxyTrace {
+  struct ncclProxyTraceEvent* events;
+  uint64_t mask;   // Size of events minus one, size is a power of two
+  uint64_t count;  // Events recorded so far
+  int sample;
+  uint64_t ops;    // Ops seen, for sampling
+  int dumpSeq;
+  char path[1024];
+};
+
+// Returns with *trace NULL if tracing is disabled
+ncclResult_t ncclProxyTraceCreate(struct ncclProxyTrace** trace);
+ncclResult_t ncclProxyTraceDump(struct ncclProxyTrace* trace);
+void ncclProxyTraceFree(struct ncclProxyTrace* trace);
+
+// Bumped on SIGUSR2 ; proxy threads dump their trace when it changes
+extern volatile int ncclProxyTraceDumpSeq;
+
+static inline struct ncclProxyTraceEvent* ncclProxyTraceNext(struct ncclProxyTrace* trace) {
+  return trace->events + (trace->count++ & trace->mask);
+}
+
+#endif
@@ -11,6 +11,8 @@
 #include "graph.h"
 #include "nvmlwrap.h"
 #include "core.h"
+#include "arena.h"
+#include "trace.h"
 
 #define NTRANSPORTS 3
 #define TRANSPORT_P2P 0
@@ -63,6 +65,8 @@ struct ncclProxyArgs {
   uint64_t end;
   void* requests[NCCL_STEPS];
   int idle;
+  double readyTime;
+  int traced;
 
   // Element linking
   pthread_mutex_t mutex;
@@ -70,14 +74,95 @@ struct ncclProxyArgs {
   struct ncclProxyArgs* nextPeer;
 };
 
-struct ncclProxyPool;
+#define NCCL_PROXY_MAX_THREADS 16
+#define NCCL_PROXY_MAX_URGENT 16
+#define NCCL_PROXY_LATENCY_BUCKETS 24
+
+// A proxy thread progresses the ops of one or several ncclProxyState. It
+// belongs to a single communicator, unless NCCL_PROXY_SHARED is set.
+struct ncclProxyThread {
+  pthread_t thread;
+  char name[64];
+  // Key of shared threads (NIC, or -2 for the process-wide thread), and
+  // number of proxy states using the thread. Protected by the shared lock.
+  int key;
+  int refCount;
+  struct ncclProxyThread* next;
+  // Cores local to the NICs served by this thread. Empty means no pinning.
+  cpu_set_t cpuset;
+  volatile int stop;
+  // States progressed by the thread, owned by the thread. New states are
+  // pushed to attach and picked up by the thread.
+  struct ncclProxyState* states;
+  struct ncclProxyState* volatile attach;
+  // The proxy thread sleeps on wakeSeq (futex) ; wakers bump it when sleeping is set
+  volatile int sleeping;
+  volatile int wakeSeq;
+  volatile double wakeTime;
+  // Backoff when all ops are idle : spin, then yield, then sleep
+  int spinUs;
+  int yieldUs;
+  int maxSleepUs;
+
+  // Statistics, reported when the proxy thread exits
+  double startTime;
+  double idleTime;  // Time during which all ops were idle
+  double sleepTime;
+  uint64_t sleeps;
+  uint64_t timedSleeps;
+  uint64_t yields;
+  uint64_t wakeUps;  // Sleeps ended by a wake-up
+  double wakeLatency;
+  double maxWakeLatency;
+  volatile uint64_t wakes;  // Wake-ups sent
+
+  // Timeline of the ops, NULL unless NCCL_PROXY_TRACE is set
+  struct ncclProxyTrace* trace;
+};
+
 struct ncclProxyState {
-  pthread_cond_t cond;
-  pthread_mutex_t mutex;
-  bool stop;
+  struct ncclComm* comm;
+  int traceId; // Tells communicators apart in proxy traces
+  struct ncclProxyThread* thread;
+  // Element linking in the thread states list
+  struct ncclProxyState* next;
+  // Set by the communicator before it is destroyed. The thread stops using
+  // the state and sets detached once all ops completed, or right away if the
+  // communicator was aborted or failed.
+  volatile int detach;
+  volatile int detached;
+  // New ops, most recent first. Pushed by the user thread and taken all at
+  // once by the proxy thread, without locking.
+  struct ncclProxyArgs* volatile incoming;
+  // Ops saved since the last launch, most recent first, owned by the user
+  // thread. They are moved to incoming by transportStartProxy.
+  struct ncclProxyArgs* staged;
+  struct ncclProxyArgs* stagedLast;
+  // Circular list of active ops, owned by the proxy thread
   struct ncclProxyArgs* ops;
+  // Free elements, owned by the user thread
   struct ncclProxyArgs* pool;
-  struct ncclProxyPool* pools;
+  // Elements released by the proxy thread, given back to pool when it is empty
+  struct ncclProxyArgs* volatile freeOps;
+  // Memory for the ops and for the resources of the connections progressed
+  // by this state, on the NUMA node of its NIC. Released with the comm.
+  struct ncclArena arena;
+  ncclResult_t error;
+
+  // Scheduling, owned by the proxy thread. The most urgent ops are
+  // progressed again every priority ops (NCCL_PROXY_PRIORITY). They are
+  // picked during each pass, and new ops join them if they rank better than
+  // the worst op of the last pass.
+  int priority;
+  struct ncclProxyArgs* urgent[NCCL_PROXY_MAX_URGENT];
+  int nUrgent;
+  int urgentRank;
+  int maxRank;
+  // Op latency per protocol, in power of two microsecond buckets, from the
+  // time the proxy thread picks ops up until they complete
+  // (NCCL_PROXY_HISTOGRAMS=1). Reported when the state is destroyed.
+  int histograms;
+  uint64_t latency[NCCL_NUM_PROTOCOLS][NCCL_PROXY_LATENCY_BUCKETS];
 };
 
 struct ncclTransportComm {
@@ -104,11 +189,14 @@ enum proxyMode {
   proxyTo = 2
 };
 
-ncclResult_t transportAllocateProxyArgs(struct ncclComm* comm, struct ncclProxyArgs** argsptr);
+ncclResult_t transportAllocateProxyArgs(struct ncclProxyState* state, struct ncclProxyArgs** argsptr);
+ncclResult_t transportAllocateProxyResources(struct ncclConnector* connector, int channelId, size_t size, void** ptr);
 ncclResult_t transportSaveProxies(struct ncclProxyArgs* args, int pattern, int root, int nranks);
 ncclResult_t transportStartProxy(struct ncclComm* comm);
-ncclResult_t transportCreateProxy(struct ncclComm* comm);
+ncclResult_t transportCancelProxy(struct ncclComm* comm);
+ncclResult_t transportCreateProxy(struct ncclComm* comm, struct ncclTopoGraph* graph);
 ncclResult_t transportDestroyProxy(struct ncclComm* comm);
+ncclResult_t transportFreeProxyResources(struct ncclComm* comm);
 
 #include <unistd.h>
 
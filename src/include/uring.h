@@ -0,0 +1,175 @@
+/*************************************************************************
+ * Copyright (c) 2020, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_URING_H_
+#define NCCL_URING_H_
+
+// Minimal io_uring support, talking to the kernel directly so that we do
+// not add a dependency on liburing.
+
+#include "core.h"
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <string.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(IO_URING_OP_SUPPORTED)
+#define NCCL_URING_SUPPORTED 1
+#endif
+#endif
+#endif
+
+#ifdef NCCL_URING_SUPPORTED
+
+struct ncclUring {
+  int fd;
+  // Submission queue
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned* sqMask;
+  unsigned* sqArray;
+  unsigned sqEntries;
+  unsigned sqLocalTail;
+  unsigned sqSubmitted;
+  struct io_uring_sqe* sqes;
+  // Completion queue
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned* cqMask;
+  struct io_uring_cqe* cqes;
+  // Mappings
+  void* sqRing;
+  size_t sqRingSize;
+  void* cqRing;
+  size_t cqRingSize;
+  size_t sqesSize;
+};
+
+static int ncclUringOpSupported(int fd, const int* ops, int nops) {
+  const int maxOps = 256;
+  char buff[sizeof(struct io_uring_probe)+maxOps*sizeof(struct io_uring_probe_op)];
+  memset(buff, 0, sizeof(buff));
+  struct io_uring_probe* probe = (struct io_uring_probe*)buff;
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, maxOps) != 0) return 0;
+  for (int i=0; i<nops; i++) {
+    if (ops[i] > probe->last_op || (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED) == 0) return 0;
+  }
+  return 1;
+}
+
+static ncclResult_t ncclUringClose(struct ncclUring* ring) {
+  if (ring->sqes) munmap(ring->sqes, ring->sqesSize);
+  if (ring->cqRing) munmap(ring->cqRing, ring->cqRingSize);
+  if (ring->sqRing) munmap(ring->sqRing, ring->sqRingSize);
+  if (ring->fd != -1) close(ring->fd);
+  memset(ring, 0, sizeof(struct ncclUring));
+  ring->fd = -1;
+  return ncclSuccess;
+}
+
+// Create a ring and check the kernel supports the opcodes we need. Failures
+// are not reported as warnings since callers are expected to fall back to
+// regular system calls.
+static ncclResult_t ncclUringInit(struct ncclUring* ring, unsigned entries, const int* ops, int nops) {
+  memset(ring, 0, sizeof(struct ncclUring));
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd == -1) {
+    INFO(NCCL_NET, "io_uring_setup failed : %s", strerror(errno));
+    ring->fd = -1;
+    return ncclSystemError;
+  }
+  if (ncclUringOpSupported(ring->fd, ops, nops) == 0) {
+    INFO(NCCL_NET, "io_uring does not support the required operations");
+    goto fail;
+  }
+
+  ring->sqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+  ring->cqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+  ring->sqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+  ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sqRing == MAP_FAILED) { ring->sqRing = NULL; goto mapfail; }
+  ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  if (ring->cqRing == MAP_FAILED) { ring->cqRing = NULL; goto mapfail; }
+  ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) { ring->sqes = NULL; goto mapfail; }
+
+  ring->sqHead = (unsigned*)((char*)ring->sqRing + params.sq_off.head);
+  ring->sqTail = (unsigned*)((char*)ring->sqRing + params.sq_off.tail);
+  ring->sqMask = (unsigned*)((char*)ring->sqRing + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned*)((char*)ring->sqRing + params.sq_off.array);
+  ring->sqEntries = params.sq_entries;
+  ring->sqLocalTail = ring->sqSubmitted = *ring->sqTail;
+  ring->cqHead = (unsigned*)((char*)ring->cqRing + params.cq_off.head);
+  ring->cqTail = (unsigned*)((char*)ring->cqRing + params.cq_off.tail);
+  ring->cqMask = (unsigned*)((char*)ring->cqRing + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)((char*)ring->cqRing + params.cq_off.cqes);
+  return ncclSuccess;
+mapfail:
+  INFO(NCCL_NET, "io_uring mmap failed : %s", strerror(errno));
+fail:
+  ncclUringClose(ring);
+  return ncclSystemError;
+}
+
+// Queue a new SQE. Returns ncclInternalError if the submission queue is full.
+static ncclResult_t ncclUringPrep(struct ncclUring* ring, int opcode, int fd, void* addr, unsigned len, int msgFlags, uint64_t userData) {
+  unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (ring->sqLocalTail - head >= ring->sqEntries) {
+    WARN("io_uring submission queue is full");
+    return ncclInternalError;
+  }
+  unsigned index = ring->sqLocalTail & *ring->sqMask;
+  struct io_uring_sqe* sqe = ring->sqes+index;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)addr;
+  sqe->len = len;
+  sqe->msg_flags = msgFlags;
+  sqe->user_data = userData;
+  ring->sqArray[index] = index;
+  ring->sqLocalTail++;
+  return ncclSuccess;
+}
+
+// Submit all queued SQEs and wait until at least waitNr completions are available.
+static ncclResult_t ncclUringSubmitAndWait(struct ncclUring* ring, unsigned waitNr) {
+  __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+  unsigned toSubmit = ring->sqLocalTail - ring->sqSubmitted;
+  unsigned flags = waitNr ? IORING_ENTER_GETEVENTS : 0;
+  while (toSubmit || waitNr) {
+    int ret = syscall(__NR_io_uring_enter, ring->fd, toSubmit, waitNr, flags, NULL, 0);
+    if (ret == -1) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+      WARN("Call to io_uring_enter failed : %s", strerror(errno));
+      return ncclSystemError;
+    }
+    if (ret == 0 && toSubmit) break;
+    ring->sqSubmitted += ret;
+    toSubmit -= ret;
+    waitNr = 0;
+  }
+  return ncclSuccess;
+}
+
+// Return the next completion or NULL. Call ncclUringCqeSeen once it has been consumed.
+static struct io_uring_cqe* ncclUringPeekCqe(struct ncclUring* ring) {
+  unsigned head = *ring->cqHead;
+  if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) return NULL;
+  return ring->cqes + (head & *ring->cqMask);
+}
+
+static void ncclUringCqeSeen(struct ncclUring* ring) {
+  __atomic_store_n(ring->cqHead, *ring->cqHead+1, __ATOMIC_RELEASE);
+}
+
+#endif
+
+#endif
@@ -9,6 +9,7 @@
 
 #include "nccl.h"
 #include <stdint.h>
+#include <time.h>
 
 int ncclCudaCompCap();
 
@@ -37,4 +38,11 @@ static long log2i(long n) {
  return l;
 }
 
+// Monotonic time in microseconds, for timings
+static double ncclTimeUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e6 + ts.tv_nsec*1e-3;
+}
+
 #endif
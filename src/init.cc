@@ -166,6 +166,7 @@ static ncclResult_t commFree(ncclComm_t comm) {
 
   for (int channel=0; channel<comm->nChannels; channel++)
     NCCLCHECK(freeChannel(comm->channels+channel, comm->nRanks));
+  NCCLCHECK(transportFreeProxyResources(comm));
 
   if (comm->doneEvent != NULL)
     CUDACHECK(cudaEventDestroy(comm->doneEvent));
@@ -399,6 +400,12 @@ ncclResult_t ncclCommSetIntra(struct ncclComm* comm, int rank, int ranks, struct
   return ncclSuccess;
 }
 
+// Bootstrap tags : connect info of our recv and send connectors on each
+// channel, then collNet connect info
+#define P2P_RECV_TAG(channel) (2*(channel)->id)
+#define P2P_SEND_TAG(channel) (2*(channel)->id+1)
+#define COLLNET_TAG(channel) (2*MAXCHANNELS+(channel)->id)
+
 static ncclResult_t p2pSetup(struct ncclComm* comm, struct ncclTopoGraph* graph, struct ncclChannel* channel, int nrecv, int* peerRecv, int nsend, int* peerSend) {
   TRACE(NCCL_INIT, "nsend %d nrecv %d", nsend, nrecv);
   uint32_t nSkippedSend = 0, nSkippedRecv = 0; /* for tracing */
@@ -411,7 +418,7 @@ static ncclResult_t p2pSetup(struct ncclComm* comm, struct ncclTopoGraph* graph,
     if (conn->connected) { ++nSkippedRecv; continue; }
     memset(&connect, 0, sizeof(connect));
     NCCLCHECK(selectTransport<0>(comm->topo, graph, comm->peerInfo+comm->rank, comm->peerInfo+peer, &connect, conn, channel->buffSize, channel->id));
-    NCCLCHECK(bootstrapSend(comm->bootstrap, peer, &connect, sizeof(struct ncclConnect)));
+    NCCLCHECK(bootstrapSend(comm->bootstrap, peer, P2P_RECV_TAG(channel), &connect, sizeof(struct ncclConnect)));
   }
   for (int i=0; i<nsend; i++) {
     int peer = peerSend[i];
@@ -420,7 +427,7 @@ static ncclResult_t p2pSetup(struct ncclComm* comm, struct ncclTopoGraph* graph,
     if (conn->connected) { ++nSkippedSend; continue; }
     memset(&connect, 0, sizeof(connect));
     NCCLCHECK(selectTransport<1>(comm->topo, graph, comm->peerInfo+comm->rank, comm->peerInfo+peer, &connect, conn, channel->buffSize, channel->id));
-    NCCLCHECK(bootstrapSend(comm->bootstrap, peer, &connect, sizeof(struct ncclConnect)));
+    NCCLCHECK(bootstrapSend(comm->bootstrap, peer, P2P_SEND_TAG(channel), &connect, sizeof(struct ncclConnect)));
   }
   for (int i=0; i<nsend; i++) {
     int peer = peerSend[i];
@@ -428,7 +435,7 @@ static ncclResult_t p2pSetup(struct ncclComm* comm, struct ncclTopoGraph* graph,
     conn = &channel->peers[peer].send;
     if (conn->connected) {++nSkippedSend; continue; }
     memset(&connect, 0, sizeof(connect));
-    NCCLCHECK(bootstrapRecv(comm->bootstrap, peer, &connect, sizeof(struct ncclConnect)));
+    NCCLCHECK(bootstrapRecv(comm->bootstrap, peer, P2P_RECV_TAG(channel), &connect, sizeof(struct ncclConnect)));
     NCCLCHECK(conn->transportComm->connect(&connect, 1, comm->rank, conn));
     conn->connected = 1;
   }
@@ -438,7 +445,7 @@ static ncclResult_t p2pSetup(struct ncclComm* comm, struct ncclTopoGraph* graph,
     conn = &channel->peers[peer].recv;
     if (conn->connected) {++nSkippedRecv; continue; }
     memset(&connect, 0, sizeof(connect));
-    NCCLCHECK(bootstrapRecv(comm->bootstrap, peer, &connect, sizeof(struct ncclConnect)));
+    NCCLCHECK(bootstrapRecv(comm->bootstrap, peer, P2P_SEND_TAG(channel), &connect, sizeof(struct ncclConnect)));
     NCCLCHECK(conn->transportComm->connect(&connect, 1, comm->rank, conn));
     conn->connected = 1;
   }
@@ -470,7 +477,7 @@ static int collNetSetup(struct ncclComm* comm, struct ncclTopoGraph* collNetGrap
 
   // send master receives connect info from peer recv master
   if (isMaster && type == 0) {
-    NCCLCHECK(bootstrapRecv(comm->bootstrap, masterPeer, &sendrecvExchange, sizeof(sendrecvExchange)));
+    NCCLCHECK(bootstrapRecv(comm->bootstrap, masterPeer, COLLNET_TAG(channel), &sendrecvExchange, sizeof(sendrecvExchange)));
     rankInCollNet = sendrecvExchange.collNetRank;
     INFO(NCCL_INIT, "CollNet [send] : rank %d collNetRank %d collNetNranks %d received connect from rank %d", rank, rankInCollNet, nMasters, masterPeer);
   }
@@ -519,7 +526,7 @@ static int collNetSetup(struct ncclComm* comm, struct ncclTopoGraph* collNetGrap
   if (isMaster && type == 1) {
     sendrecvExchange.collNetRank = rankInCollNet;
     memcpy(&sendrecvExchange.connect, masterConnects+rankInCollNet, sizeof(struct ncclConnect));
-    NCCLCHECK(bootstrapSend(comm->bootstrap, masterPeer, &sendrecvExchange, sizeof(sendrecvExchange)));
+    NCCLCHECK(bootstrapSend(comm->bootstrap, masterPeer, COLLNET_TAG(channel), &sendrecvExchange, sizeof(sendrecvExchange)));
     INFO(NCCL_INIT, "CollNet [recv] : rank %d collNetRank %d collNetNranks %d sent connect to rank %d", rank, rankInCollNet, nMasters, masterPeer);
   }
   if (ret > 0) {
@@ -533,18 +540,8 @@ cleanup:
 
 static ncclResult_t checkCollNetSetup(struct ncclComm* comm, int rank, int collNetSetupFail) {
   int nranks = comm->nRanks;
-  // AllGather collNet setup results
-  int* allGatherFailures;
-  NCCLCHECK(ncclCalloc(&allGatherFailures, nranks));
-  allGatherFailures[rank] = collNetSetupFail;
-  NCCLCHECK(bootstrapAllGather(comm->bootstrap, allGatherFailures, sizeof(int)));
-  for (int i=0; i<nranks; i++) {
-    if (allGatherFailures[i] != 0) {
-      collNetSetupFail = 1;
-      break;
-    }
-  }
-  free(allGatherFailures);
+  // Fail if any rank failed
+  NCCLCHECK(bootstrapAllReduce(comm->bootstrap, &collNetSetupFail, 1, ncclMax));
   if (collNetSetupFail) {
     if (rank == 0) WARN("Cannot initialize CollNet, using %s instead", ncclNetName());
     // Free collNet resources
@@ -567,7 +564,9 @@ static ncclResult_t checkCollNetSetup(struct ncclComm* comm, int rank, int collN
 NCCL_PARAM(CrossNic, "CROSS_NIC", 2);
 NCCL_PARAM(GraphDumpFileRank, "GRAPH_DUMP_FILE_RANK", 0);
 
-static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* commId) {
+// Bootstrap runs in the background from the start of init. We only join it
+// (pendingBootstrap) when AllGather1 needs it.
+static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* commId, void** pendingBootstrap) {
   // We use 3 AllGathers
   // 1. { peerInfo, comm }
   // 2. ConnectTransport[nranks], ConnectValue[nranks]
@@ -577,7 +576,7 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   int nranks = comm->nRanks;
   uint64_t commHash = getHash(commId->internal, NCCL_UNIQUE_ID_BYTES);
   TRACE(NCCL_INIT, "comm %p, commHash %lx, rank %d nranks %d - BEGIN", comm, commHash, rank, nranks);
-  NCCLCHECK(bootstrapInit(commId, rank, nranks, &comm->bootstrap));
+  double tStart = ncclTimeUs();
 
   // AllGather1 - begin
   struct {
@@ -589,6 +588,11 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   allGather1Data[rank].comm = comm;
   struct ncclPeerInfo* myInfo = &allGather1Data[rank].peerInfo;
   NCCLCHECK(fillInfo(comm, myInfo, commHash));
+  double tLocal = ncclTimeUs();
+  void* pending = *pendingBootstrap;
+  *pendingBootstrap = NULL;
+  NCCLCHECK(bootstrapInitWait(pending, &comm->bootstrap));
+  double tBootstrap = ncclTimeUs();
   NCCLCHECK(bootstrapAllGather(comm->bootstrap, allGather1Data, sizeof(*allGather1Data)));
 
   NCCLCHECK(ncclCalloc(&comm->peerInfo, nranks+1)); // Extra rank to represent CollNet root
@@ -601,6 +605,7 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   }
   // AllGather1 data is used again below
   // AllGather1 - end
+  double tAllGather1 = ncclTimeUs();
 
   // Topo detection / System graph creation
   NCCLCHECK(ncclTopoGetSystem(comm, &comm->topo));
@@ -614,6 +619,7 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   NCCLCHECK(ncclTopoSearchInit(comm->topo));
   // Print final topology
   NCCLCHECK(ncclTopoPrint(comm->topo));
+  double tTopo = ncclTimeUs();
 
   // Get rings and trees
   struct ncclTopoGraph ringGraph;
@@ -649,6 +655,7 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
     struct ncclTopoGraph* graphs[3] = { &ringGraph, &treeGraph, &collNetGraph };
     NCCLCHECK(ncclTopoDumpGraphs(comm->topo, 3, graphs));
   }
+  double tGraphs = ncclTimeUs();
 
   // AllGather3 - begin
   struct ncclGraphInfo {
@@ -755,6 +762,7 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   free(allGather3Data);
 
   // AllGather3 - end
+  double tAllGather3 = ncclTimeUs();
 
   TRACE(NCCL_INIT, "rank %d nranks %d - BUILT %d TREES/RINGS", rank, nranks, comm->nChannels);
 
@@ -772,6 +780,9 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   line[1023] = '\0';
   INFO(NCCL_INIT, "Trees%s", line);
 
+  // Connections with a proxy allocate their resources from the proxy states
+  if (comm->nNodes) NCCLCHECK(transportCreateProxy(comm, &ringGraph));
+
   // Set Affinity to a CPU local the our GPU, so that all memory we allocate
   // on the host is local.
   cpu_set_t affinitySave;
@@ -846,25 +857,42 @@ affinity_restore:
   // Done with AllGather1 data
   free(allGather1Data);
 
-  if (comm->nNodes) NCCLCHECK(transportCreateProxy(comm));
-
+  double tEnd = ncclTimeUs();
+  INFO(NCCL_INIT, "comm %p rank %d init timings (ms) : local %.2f, bootstrap wait %.2f, allgather1 %.2f, topo %.2f, graphs %.2f, allgather3 %.2f, connect %.2f",
+      comm, rank, (tLocal-tStart)*1e-3, (tBootstrap-tLocal)*1e-3, (tAllGather1-tBootstrap)*1e-3, (tTopo-tAllGather1)*1e-3,
+      (tGraphs-tTopo)*1e-3, (tAllGather3-tGraphs)*1e-3, (tEnd-tAllGather3)*1e-3);
   TRACE(NCCL_INIT, "rank %d nranks %d - DONE", rank, nranks);
   return ncclSuccess;
 }
 
 ncclResult_t ncclCommInitRankSync(ncclComm_t* newcomm, int nranks, ncclUniqueId commId, int myrank, int cudaDev) {
   ncclResult_t res;
+  void* pendingBootstrap = NULL;
+  *newcomm = NULL;
 
   CUDACHECK(cudaSetDevice(cudaDev));
+  // Bootstrap does not need the comm, let it run while we set it up
+  NCCLCHECKGOTO(bootstrapInitAsync(&commId, myrank, nranks, &pendingBootstrap), res, cleanup);
   NCCLCHECKGOTO(commAlloc(newcomm, nranks, myrank), res, cleanup);
-  NCCLCHECKGOTO(initTransportsRank(*newcomm, &commId), res, cleanup);
+  NCCLCHECKGOTO(initTransportsRank(*newcomm, &commId, &pendingBootstrap), res, cleanup);
   NCCLCHECKGOTO(devCommSetup(*newcomm), res, cleanup);
 
   INFO(NCCL_INIT,"comm %p rank %d nranks %d cudaDev %d busId %x - Init COMPLETE", *newcomm, myrank, nranks, (*newcomm)->cudaDev, (*newcomm)->busId);
 
   return ncclSuccess;
 cleanup:
-  if ((*newcomm) && (*newcomm)->bootstrap) bootstrapAbort((*newcomm)->bootstrap);
+  if (pendingBootstrap) {
+    void* bootstrap;
+    bootstrapInitWait(pendingBootstrap, &bootstrap);
+    if (bootstrap) bootstrapAbort(bootstrap);
+  }
+  if (*newcomm) {
+    // The proxy threads are started before the connections are set up ;
+    // stop them and release the arenas before giving up on the comm.
+    transportDestroyProxy(*newcomm);
+    transportFreeProxyResources(*newcomm);
+    if ((*newcomm)->bootstrap) bootstrapAbort((*newcomm)->bootstrap);
+  }
   *newcomm = NULL;
   return res;
 }
@@ -0,0 +1,91 @@
+/*************************************************************************
+ * Copyright (c) 2020, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "arena.h"
+#include "core.h"
+#include "align.h"
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+NCCL_PARAM(ArenaNuma, "ARENA_NUMA", 1);
+
+#define ARENA_CHUNK_SIZE (1<<16)
+#define ARENA_ALIGN 64
+#define ARENA_MAX_NUMA 1024
+
+struct ncclArenaChunk {
+  struct ncclArenaChunk* next;
+  size_t size;
+};
+
+// Chunk header, padded so that blocks stay aligned
+#define ARENA_HEADER_SIZE ROUNDUP(sizeof(struct ncclArenaChunk), ARENA_ALIGN)
+
+void ncclArenaInit(struct ncclArena* arena, const char* name, int numaId) {
+  memset(arena, 0, sizeof(struct ncclArena));
+  snprintf(arena->name, sizeof(arena->name), "%s", name);
+  arena->numaId = ncclParamArenaNuma() ? numaId : -1;
+}
+
+// Prefer numaId for the pages of a chunk. Pages are only allocated when first
+// touched, so they follow the policy whatever thread touches them. We call
+// mbind directly to avoid depending on libnuma.
+static int arenaBind(void* addr, size_t size, int numaId) {
+  unsigned long mask[ARENA_MAX_NUMA/(8*sizeof(unsigned long))];
+  memset(mask, 0, sizeof(mask));
+  mask[numaId/(8*sizeof(unsigned long))] = 1UL << (numaId%(8*sizeof(unsigned long)));
+  return syscall(SYS_mbind, addr, size, MPOL_PREFERRED, mask, ARENA_MAX_NUMA+1, 0);
+}
+
+ncclResult_t ncclArenaAlloc(struct ncclArena* arena, size_t size, void** ptr) {
+  size = ROUNDUP(size, ARENA_ALIGN);
+  if (size > arena->left) {
+    size_t chunkSize = std::max((size_t)ARENA_CHUNK_SIZE, ROUNDUP(size+ARENA_HEADER_SIZE, ARENA_CHUNK_SIZE));
+    void* p = mmap(NULL, chunkSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      WARN("Arena %s : failed to map %ld bytes : %s", arena->name, chunkSize, strerror(errno));
+      return ncclSystemError;
+    }
+    if (arena->numaId >= 0 && arena->numaId < ARENA_MAX_NUMA) {
+      if (arenaBind(p, chunkSize, arena->numaId) == 0) {
+        arena->bound = 1;
+      } else if (arena->nChunks == 0) {
+        INFO(NCCL_INIT, "Arena %s : could not bind memory to NUMA node %d : %s", arena->name, arena->numaId, strerror(errno));
+      }
+    }
+    struct ncclArenaChunk* chunk = (struct ncclArenaChunk*)p;
+    chunk->size = chunkSize;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->cur = (char*)p + ARENA_HEADER_SIZE;
+    arena->left = chunkSize - ARENA_HEADER_SIZE;
+    arena->nChunks++;
+    arena->mapped += chunkSize;
+  }
+  // Anonymous mappings are zeroed, and blocks are never reused
+  *ptr = arena->cur;
+  arena->cur += size;
+  arena->left -= size;
+  arena->used += size;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclArenaRelease(struct ncclArena* arena) {
+  if (arena->nChunks) {
+    INFO(NCCL_INIT, "Arena %s : NUMA node %d%s, high-water %ld bytes, %ld bytes in %d chunks", arena->name, arena->numaId,
+        arena->numaId == -1 || arena->bound ? "" : " (not bound)", arena->used, arena->mapped, arena->nChunks);
+  }
+  while (arena->chunks) {
+    struct ncclArenaChunk* next = arena->chunks->next;
+    SYSCHECK(munmap(arena->chunks, arena->chunks->size), "munmap");
+    arena->chunks = next;
+  }
+  arena->cur = NULL;
+  arena->left = 0;
+  arena->nChunks = 0;
+  return ncclSuccess;
+}
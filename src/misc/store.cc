@@ -0,0 +1,267 @@
+/*************************************************************************
+ * Copyright (c) 2020, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "core.h"
+#include "store.h"
+#include "socket.h"
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define STR2(v) #v
+#define STR(v) STR2(v)
+
+/* File store : each key is a file in the store directory. Values are
+ * written to a temporary file which is then renamed, so that readers
+ * never see partial values. Readers poll until the file shows up.
+ */
+#define STORE_FILE_MAX_SLEEP 100000 // usec
+
+struct ncclStoreFileComm {
+  // Leaves room for the key and the temporary file suffix within PATH_MAX
+  char dir[PATH_MAX-NCCL_STORE_KEY_MAXSIZE-32];
+};
+
+static ncclResult_t storeFilePath(struct ncclStoreFileComm* comm, const char* key, bool tmp, char* path) {
+  int len = tmp ? snprintf(path, PATH_MAX, "%s/.%s.%d", comm->dir, key, getpid()) : snprintf(path, PATH_MAX, "%s/%s", comm->dir, key);
+  if (len < 0 || len >= PATH_MAX) {
+    WARN("Store : path for key %s is too long", key);
+    return ncclInvalidArgument;
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t storeFileOpen(const char* config, void** store) {
+  struct ncclStoreFileComm* comm;
+  if (strlen(config) == 0 || strlen(config) >= sizeof(comm->dir)) {
+    WARN("Store : invalid directory '%s'", config);
+    return ncclInvalidArgument;
+  }
+  if (mkdir(config, 0777) != 0 && errno != EEXIST) {
+    WARN("Store : could not create directory %s : %s", config, strerror(errno));
+    return ncclSystemError;
+  }
+  NCCLCHECK(ncclCalloc(&comm, 1));
+  strcpy(comm->dir, config);
+  *store = comm;
+  return ncclSuccess;
+}
+
+static ncclResult_t storeFileSet(void* store, const char* key, const void* value, int size) {
+  struct ncclStoreFileComm* comm = (struct ncclStoreFileComm*)store;
+  char path[PATH_MAX], tmpPath[PATH_MAX];
+  NCCLCHECK(storeFilePath(comm, key, false, path));
+  NCCLCHECK(storeFilePath(comm, key, true, tmpPath));
+  int fd;
+  SYSCHECKVAL(open(tmpPath, O_CREAT|O_WRONLY|O_TRUNC, 0644), "open", fd);
+  int offset = 0;
+  while (offset < size) {
+    int bytes;
+    SYSCHECKSYNC(write(fd, (const char*)value+offset, size-offset), "write", bytes);
+    if (bytes == -1) {
+      WARN("Store : could not write %s : %s", tmpPath, strerror(errno));
+      close(fd);
+      return ncclSystemError;
+    }
+    offset += bytes;
+  }
+  SYSCHECK(close(fd), "close");
+  SYSCHECK(rename(tmpPath, path), "rename");
+  return ncclSuccess;
+}
+
+static ncclResult_t storeFileGet(void* store, const char* key, void* value, int size) {
+  struct ncclStoreFileComm* comm = (struct ncclStoreFileComm*)store;
+  char path[PATH_MAX];
+  NCCLCHECK(storeFilePath(comm, key, false, path));
+  int fd, sleepTime = 1000;
+  while ((fd = open(path, O_RDONLY)) == -1) {
+    if (errno != ENOENT && errno != EINTR) {
+      WARN("Store : could not open %s : %s", path, strerror(errno));
+      return ncclSystemError;
+    }
+    usleep(sleepTime);
+    sleepTime = std::min(2*sleepTime, STORE_FILE_MAX_SLEEP);
+  }
+  int offset = 0, bytes = 0;
+  do {
+    SYSCHECKSYNC(read(fd, (char*)value+offset, size-offset), "read", bytes);
+    if (bytes > 0) offset += bytes;
+  } while (bytes > 0 && offset < size);
+  // Make sure there is nothing left
+  char extra;
+  if (bytes >= 0 && offset == size) SYSCHECKSYNC(read(fd, &extra, 1), "read", bytes);
+  close(fd);
+  if (bytes != 0 || offset != size) {
+    WARN("Store : %s does not hold %d bytes", path, size);
+    return ncclInternalError;
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t storeFileRemove(void* store, const char* key) {
+  struct ncclStoreFileComm* comm = (struct ncclStoreFileComm*)store;
+  char path[PATH_MAX];
+  NCCLCHECK(storeFilePath(comm, key, false, path));
+  if (unlink(path) != 0 && errno != ENOENT) {
+    WARN("Store : could not remove %s : %s", path, strerror(errno));
+    return ncclSystemError;
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t storeFileClose(void* store) {
+  free(store);
+  return ncclSuccess;
+}
+
+static ncclStore_t storeFile = {
+  "File",
+  NULL,
+  storeFileOpen,
+  storeFileSet,
+  storeFileGet,
+  storeFileRemove,
+  storeFileClose
+};
+
+/* TCP store : each request starts with a header giving the operation, the
+ * key size and the value size, followed by the key (without NUL) and, for
+ * SET, the value. The server answers GET with the value size and the value
+ * once the key is set, and does not answer SET and REMOVE. Requests of a
+ * connection are processed in order.
+ */
+#define STORE_TCP_SET 0
+#define STORE_TCP_GET 1
+#define STORE_TCP_REMOVE 2
+
+struct ncclStoreTcpHeader {
+  int op;
+  int keySize;
+  int valueSize;
+};
+
+struct ncclStoreTcpComm {
+  int fd;
+};
+
+static ncclResult_t storeTcpOpen(const char* config, void** store) {
+  union socketAddress addr;
+  if (GetSocketAddrFromString(&addr, config) != ncclSuccess) {
+    WARN("Store : invalid server address '%s', please use <host>:<port>", config);
+    return ncclInvalidArgument;
+  }
+  struct ncclStoreTcpComm* comm;
+  NCCLCHECK(ncclCalloc(&comm, 1));
+  NCCLCHECK(connectAddress(&comm->fd, &addr));
+  *store = comm;
+  return ncclSuccess;
+}
+
+static ncclResult_t storeTcpRequest(struct ncclStoreTcpComm* comm, int op, const char* key, const void* value, int size) {
+  struct ncclStoreTcpHeader hdr = { op, (int)strlen(key), op == STORE_TCP_SET ? size : 0 };
+  NCCLCHECK(socketSend(comm->fd, &hdr, sizeof(hdr)));
+  NCCLCHECK(socketSend(comm->fd, (void*)key, hdr.keySize));
+  if (hdr.valueSize) NCCLCHECK(socketSend(comm->fd, (void*)value, hdr.valueSize));
+  return ncclSuccess;
+}
+
+static ncclResult_t storeTcpSet(void* store, const char* key, const void* value, int size) {
+  NCCLCHECK(storeTcpRequest((struct ncclStoreTcpComm*)store, STORE_TCP_SET, key, value, size));
+  return ncclSuccess;
+}
+
+static ncclResult_t storeTcpGet(void* store, const char* key, void* value, int size) {
+  struct ncclStoreTcpComm* comm = (struct ncclStoreTcpComm*)store;
+  NCCLCHECK(storeTcpRequest(comm, STORE_TCP_GET, key, NULL, 0));
+  int valueSize;
+  NCCLCHECK(socketReceive(comm->fd, &valueSize, sizeof(int)));
+  if (valueSize != size) {
+    WARN("Store : key %s holds %d bytes instead of %d", key, valueSize, size);
+    return ncclInternalError;
+  }
+  NCCLCHECK(socketReceive(comm->fd, value, size));
+  return ncclSuccess;
+}
+
+static ncclResult_t storeTcpRemove(void* store, const char* key) {
+  NCCLCHECK(storeTcpRequest((struct ncclStoreTcpComm*)store, STORE_TCP_REMOVE, key, NULL, 0));
+  return ncclSuccess;
+}
+
+static ncclResult_t storeTcpClose(void* store) {
+  struct ncclStoreTcpComm* comm = (struct ncclStoreTcpComm*)store;
+  close(comm->fd);
+  free(comm);
+  return ncclSuccess;
+}
+
+static ncclStore_t storeTcp = {
+  "TCP",
+  NULL,
+  storeTcpOpen,
+  storeTcpSet,
+  storeTcpGet,
+  storeTcpRemove,
+  storeTcpClose
+};
+
+static ncclStore_t* storePlugin = NULL;
+static pthread_mutex_t storePluginLock = PTHREAD_MUTEX_INITIALIZER;
+
+static ncclResult_t storePluginInit(ncclStore_t** store) {
+  pthread_mutex_lock(&storePluginLock);
+  if (storePlugin == NULL) {
+    void* storePluginLib = dlopen("libnccl-store.so", RTLD_NOW | RTLD_LOCAL);
+    if (storePluginLib == NULL) {
+      WARN("Store/Plugin : could not load libnccl-store.so : %s", dlerror());
+    } else {
+      ncclStore_t* extStore = (ncclStore_t*) dlsym(storePluginLib, STR(NCCL_STORE_PLUGIN_SYMBOL));
+      if (extStore == NULL) {
+        WARN("Store/Plugin : failed to find " STR(NCCL_STORE_PLUGIN_SYMBOL) " symbol.");
+        dlclose(storePluginLib);
+      } else if (extStore->init(ncclDebugLog) != ncclSuccess) {
+        WARN("Store/Plugin : failed to initialize %s", extStore->name);
+        dlclose(storePluginLib);
+      } else {
+        storePlugin = extStore;
+      }
+    }
+  }
+  pthread_mutex_unlock(&storePluginLock);
+  *store = storePlugin;
+  return storePlugin ? ncclSuccess : ncclSystemError;
+}
+
+bool ncclStoreEnabled() {
+  char* env = getenv("NCCL_BOOTSTRAP_STORE");
+  return env && strlen(env) > 0;
+}
+
+ncclResult_t ncclStoreOpen(ncclStore_t** store, void** storeComm) {
+  const char* env = getenv("NCCL_BOOTSTRAP_STORE");
+  const char* config;
+  if (env == NULL) {
+    WARN("Store : NCCL_BOOTSTRAP_STORE is not set");
+    return ncclInvalidArgument;
+  } else if (strncmp(env, "file:", 5) == 0) {
+    *store = &storeFile;
+    config = env+5;
+  } else if (strncmp(env, "tcp:", 4) == 0) {
+    *store = &storeTcp;
+    config = env+4;
+  } else if (strncmp(env, "plugin", 6) == 0 && (env[6] == '\0' || env[6] == ':')) {
+    NCCLCHECK(storePluginInit(store));
+    config = env[6] ? env+7 : env+6;
+  } else {
+    WARN("Invalid NCCL_BOOTSTRAP_STORE %s, please use file:<directory>, tcp:<host>:<port> or plugin[:<config>]", env);
+    return ncclInvalidArgument;
+  }
+  NCCLCHECK((*store)->open(config, storeComm));
+  INFO(NCCL_INIT, "Bootstrap : Using %s store %s", (*store)->name, config);
+  return ncclSuccess;
+}
@@ -0,0 +1,152 @@
+/*************************************************************************
+ * Copyright (c) 2020, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "trace.h"
+#include "core.h"
+#include <signal.h>
+
+NCCL_PARAM(ProxyTrace, "PROXY_TRACE", 0);
+NCCL_PARAM(ProxyTraceSize, "PROXY_TRACE_SIZE", 1<<16);
+
+volatile int ncclProxyTraceDumpSeq = 0;
+static int traceSignalInstalled = 0;
+static int traceSeq = 0;
+
+static void traceSignalHandler(int signum) {
+  __sync_fetch_and_add(&ncclProxyTraceDumpSeq, 1);
+}
+
+// Dump on SIGUSR2, unless the application handles it
+static void traceInstallSignal() {
+  if (__sync_lock_test_and_set(&traceSignalInstalled, 1)) return;
+  struct sigaction old;
+  if (sigaction(SIGUSR2, NULL, &old) != 0 || old.sa_handler != SIG_DFL) {
+    INFO(NCCL_INIT, "Proxy trace : SIGUSR2 already handled, traces will only be written at exit");
+    return;
+  }
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = traceSignalHandler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR2, &sa, NULL);
+}
+
+ncclResult_t ncclProxyTraceCreate(struct ncclProxyTrace** trace) {
+  *trace = NULL;
+  int sample = ncclParamProxyTrace();
+  if (sample <= 0) return ncclSuccess;
+  int64_t size = 1;
+  while (size < ncclParamProxyTraceSize()) size <<= 1;
+  struct ncclProxyTrace* t;
+  NCCLCHECK(ncclCalloc(&t, 1));
+  if (ncclCalloc(&t->events, size) != ncclSuccess) {
+    free(t);
+    return ncclSystemError;
+  }
+  t->mask = size-1;
+  t->sample = sample;
+  t->dumpSeq = ncclProxyTraceDumpSeq;
+  const char* prefix = getenv("NCCL_PROXY_TRACE_FILE");
+  char hostname[256];
+  getHostName(hostname, sizeof(hostname), '.');
+  int len = snprintf(t->path, sizeof(t->path), "%s.%s.%d.%d.json", prefix ? prefix : "nccl-proxy-trace", hostname, getpid(), __sync_fetch_and_add(&traceSeq, 1));
+  if (len < 0 || len >= (int)sizeof(t->path)) {
+    WARN("Proxy trace : NCCL_PROXY_TRACE_FILE %s is too long, tracing disabled", prefix);
+    free(t->events);
+    free(t);
+    return ncclSuccess;
+  }
+  traceInstallSignal();
+  *trace = t;
+  return ncclSuccess;
+}
+
+static const char* traceProtoStr[] = { "LL", "LL128", "Simple" };
+
+// Tracks seen during a dump, in an open addressing table, with the first op
+// whose Ready event is still in the ring buffer.
+struct traceTrack {
+  uint64_t key;
+  uint64_t opCount;
+  int used;
+};
+
+static struct traceTrack* traceFindTrack(struct traceTrack* tracks, uint64_t mask, uint64_t key) {
+  uint64_t h = (key * 0x9E3779B97F4A7C15ULL) >> 32;
+  while (tracks[h & mask].used && tracks[h & mask].key != key) h++;
+  return tracks + (h & mask);
+}
+
+// Write the events still in the ring buffer, oldest first. Each connection
+// gets its own track, on which ops are slices and steps are instant events.
+// Once the buffer wrapped, the oldest ops lost their Ready event : their
+// other events are skipped, so that tracks start with a named, complete op.
+ncclResult_t ncclProxyTraceDump(struct ncclProxyTrace* trace) {
+  uint64_t first = trace->count > trace->mask ? trace->count - trace->mask - 1 : 0;
+  uint64_t nTracks = 1;
+  while (nTracks < 2*(trace->count-first)) nTracks <<= 1;
+  struct traceTrack* tracks;
+  NCCLCHECK(ncclCalloc(&tracks, nTracks));
+  FILE* file = fopen(trace->path, "w");
+  if (file == NULL) {
+    WARN("Proxy trace : could not open %s : %s", trace->path, strerror(errno));
+    free(tracks);
+    return ncclSystemError;
+  }
+  int self = getpid();
+  uint64_t written = 0;
+  fprintf(file, "{\"traceEvents\":[");
+  for (uint64_t e=first; e<trace->count; e++) {
+    struct ncclProxyTraceEvent* event = trace->events + (e & trace->mask);
+    int pid = event->comm;
+    uint64_t tid = ((uint64_t)event->channel << 24) | ((uint64_t)event->send << 23) | event->peer;
+    struct traceTrack* track = traceFindTrack(tracks, nTracks-1, ((uint64_t)pid << 32) | tid);
+    if (event->type == ncclProxyTraceReady && track->used == 0) {
+      track->used = 1;
+      track->key = ((uint64_t)pid << 32) | tid;
+      track->opCount = event->opCount;
+      fprintf(file, "%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"process %d comm %d rank %d\"}},\n",
+          written ? "," : "", pid, self, event->comm, event->rank);
+      fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%lu,\"args\":{\"name\":\"comm %d rank %d channel %d %s %d\"}}",
+          pid, tid, event->comm, event->rank, event->channel, event->send ? "send to" : "recv from", event->peer);
+      written++;
+    }
+    if (track->used == 0 || event->opCount < track->opCount) continue;
+    const char* sep = written++ ? ",\n" : "\n";
+    switch (event->type) {
+      case ncclProxyTraceReady:
+        fprintf(file, "%s{\"name\":\"%s %s\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":%d,\"tid\":%lu,\"args\":{\"opCount\":%lu,\"nsteps\":%lu}}",
+            sep, event->send ? "send" : "recv", traceProtoStr[event->protocol], event->time, pid, tid, event->opCount, event->step);
+        break;
+      case ncclProxyTracePosted:
+        fprintf(file, "%s{\"name\":\"posted\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%lu,\"args\":{\"opCount\":%lu}}",
+            sep, event->time, pid, tid, event->opCount);
+        break;
+      case ncclProxyTraceStep:
+        fprintf(file, "%s{\"name\":\"step\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%lu,\"args\":{\"opCount\":%lu,\"step\":%lu}}",
+            sep, event->time, pid, tid, event->opCount, event->step);
+        break;
+      case ncclProxyTraceDone:
+        fprintf(file, "%s{\"ph\":\"E\",\"ts\":%.3f,\"pid\":%d,\"tid\":%lu}", sep, event->time, pid, tid);
+        break;
+    }
+  }
+  free(tracks);
+  fprintf(file, "\n]}\n");
+  if (fclose(file) != 0) {
+    WARN("Proxy trace : could not write %s : %s", trace->path, strerror(errno));
+    return ncclSystemError;
+  }
+  INFO(NCCL_INIT, "Proxy trace : wrote %lu events to %s", trace->count-first, trace->path);
+  return ncclSuccess;
+}
+
+void ncclProxyTraceFree(struct ncclProxyTrace* trace) {
+  if (trace == NULL) return;
+  free(trace->events);
+  free(trace);
+}
@@ -6,6 +6,12 @@
 
 #include "comm.h"
 #include "info.h"
+#include "cpuset.h"
+#include "param.h"
+#include "utils.h"
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 extern struct ncclTransport p2pTransport;
 extern struct ncclTransport shmTransport;
@@ -37,42 +43,93 @@ static bool NeedProxy(int type, int pattern, int root, struct ncclRing* ring, in
 enum { proxyRecv=0, proxySend=1 };
 
 #define PROXYARGS_ALLOCATE_SIZE 32
-struct ncclProxyPool {
-  struct ncclProxyPool *next;
-  struct ncclProxyArgs elems[PROXYARGS_ALLOCATE_SIZE];
-};
 
-ncclResult_t transportAllocateProxyArgs(struct ncclComm* comm, struct ncclProxyArgs** argsptr) {
-  struct ncclProxyState* state = &comm->proxyState;
+// Lock-free stack push. Elements are only ever taken off the stack all at
+// once (see proxyPopAll), so there is no ABA issue.
+static void proxyPush(struct ncclProxyArgs* volatile* head, struct ncclProxyArgs* args) {
+  struct ncclProxyArgs* top;
+  do {
+    top = *head;
+    args->next = top;
+  } while (__sync_bool_compare_and_swap(head, top, args) == false);
+}
+
+static struct ncclProxyArgs* proxyPopAll(struct ncclProxyArgs* volatile* head) {
+  if (*head == NULL) return NULL;
+  return __sync_lock_test_and_set(head, (struct ncclProxyArgs*)NULL);
+}
+
+ncclResult_t transportAllocateProxyArgs(struct ncclProxyState* state, struct ncclProxyArgs** argsptr) {
   struct ncclProxyArgs* elem;
-  pthread_mutex_lock(&state->mutex);
+  // Take back the elements the proxy thread has released
+  if (state->pool == NULL) state->pool = proxyPopAll(&state->freeOps);
   if (state->pool == NULL) {
-    // Allocate a new pool of elements
-    struct ncclProxyPool* newPool;
-    NCCLCHECK(ncclCalloc(&newPool, 1));
-    struct ncclProxyArgs* newElems = newPool->elems;
+    // Allocate a new pool of elements. It is released with the arena.
+    struct ncclProxyArgs* newElems;
+    NCCLCHECK(ncclArenaCalloc(&state->arena, &newElems, PROXYARGS_ALLOCATE_SIZE));
     // Chain newly allocated elements
     for (int i=0; i<PROXYARGS_ALLOCATE_SIZE; i++) {
       if (i+1 < PROXYARGS_ALLOCATE_SIZE) newElems[i].next = newElems+i+1;
     }
     // Add them all to the pool list
     state->pool = newElems;
-    // Save the pool memory block for later resource release
-    newPool->next = state->pools;
-    state->pools = newPool;
   }
   elem = state->pool;
   state->pool = state->pool->next;
-  pthread_mutex_unlock(&state->mutex);
   elem->next = elem->nextPeer = NULL;
   *argsptr = elem;
   return ncclSuccess;
 }
 
-static void ProxyAppend(struct ncclConnector* connector, struct ncclProxyArgs* args) {
+// Resources of a connection with a proxy go with the state progressing it,
+// so that they live on the NUMA node of the NIC. They are not freed by the
+// transport but released with the communicator.
+ncclResult_t transportAllocateProxyResources(struct ncclConnector* connector, int channelId, size_t size, void** ptr) {
   struct ncclComm* comm = connector->comm;
-  struct ncclProxyState* state = &comm->proxyState;
-  pthread_mutex_lock(&state->mutex);
+  if (comm->nProxyStates == 0) {
+    WARN("Proxy resources allocated before the proxy was created");
+    return ncclInternalError;
+  }
+  NCCLCHECK(ncclArenaAlloc(&comm->proxyState[comm->channelProxy[channelId]].arena, size, ptr));
+  return ncclSuccess;
+}
+
+// Rank ops for scheduling, lower is more urgent. LL and LL128 ops are latency
+// bound and go first. Then ops with at most a window of steps left go before
+// longer ones, and ops with half a window of network requests in flight can
+// wait, as progressing them more often would only test those requests.
+static int proxyOpRank(struct ncclProxyArgs* op) {
+  int rank = op->protocol == NCCL_PROTO_SIMPLE ? 2 : 0;
+  if (op->state == ncclProxyOpProgress) {
+    if (op->end - op->head > (uint64_t)(NCCL_STEPS*op->sliceSteps)) rank++;
+    if (op->tail - op->head >= (uint64_t)(NCCL_STEPS/2*op->sliceSteps)) rank++;
+  } else if (op->nsteps > NCCL_STEPS*op->sliceSteps) {
+    rank++;
+  }
+  return rank;
+}
+
+static void proxyAddUrgent(struct ncclProxyState* state, struct ncclProxyArgs* op, int rank) {
+  if (rank < state->urgentRank) {
+    state->urgentRank = rank;
+    state->nUrgent = 0;
+  }
+  if (rank == state->urgentRank && state->nUrgent < NCCL_PROXY_MAX_URGENT) state->urgent[state->nUrgent++] = op;
+}
+
+static void proxyDropUrgent(struct ncclProxyArgs** urgent, int* nUrgent, struct ncclProxyArgs* op) {
+  for (int u=0; u<*nUrgent; u++) {
+    if (urgent[u] == op) urgent[u--] = urgent[--(*nUrgent)];
+  }
+}
+
+// Called by the proxy thread only
+static void ProxyAppend(struct ncclProxyState* state, struct ncclProxyArgs* args) {
+  struct ncclConnector* connector = args->connector;
+  args->next = args->nextPeer = NULL;
+  if (state->histograms) args->readyTime = ncclTimeUs();
+  struct ncclProxyTrace* trace = state->thread->trace;
+  args->traced = trace ? trace->ops++ % trace->sample == 0 : 0;
   if (connector->proxyAppend == NULL) {
     // Nothing running for that peer. Add to the circular list
     if (state->ops == NULL) {
@@ -85,15 +142,39 @@ static void ProxyAppend(struct ncclConnector* connector, struct ncclProxyArgs* a
       state->ops->next = args;
     }
     connector->proxyAppend = args;
+    // Don't wait for the next pass to favor it
+    if (state->priority) {
+      int rank = proxyOpRank(args);
+      if (rank < state->maxRank) proxyAddUrgent(state, args, rank);
+    }
   } else {
     // There is an active operation already for that peer.
     // Add it to the per-peer list
     connector->proxyAppend->nextPeer = args;
     connector->proxyAppend = args;
   }
-  pthread_mutex_unlock(&state->mutex);
 }
 
+// Move the ops posted by the user thread to the active list, in the order
+// they were posted.
+static void ProxyAppendIncoming(struct ncclProxyState* state) {
+  struct ncclProxyArgs* args = proxyPopAll(&state->incoming);
+  struct ncclProxyArgs* ordered = NULL;
+  while (args) {
+    struct ncclProxyArgs* next = args->next;
+    args->next = ordered;
+    ordered = args;
+    args = next;
+  }
+  while (ordered) {
+    struct ncclProxyArgs* next = ordered->next;
+    ProxyAppend(state, ordered);
+    ordered = next;
+  }
+}
+
+NCCL_PARAM(ProxyCoalesce, "PROXY_COALESCE", 1);
+
 template <int type>
 static ncclResult_t SaveProxy(int peer, struct ncclProxyArgs* args) {
   if (peer < 0) return ncclSuccess;
@@ -103,13 +184,30 @@ static ncclResult_t SaveProxy(int peer, struct ncclProxyArgs* args) {
   if (connector->transportComm == NULL) return ncclInternalError;
   if (connector->transportComm->proxy == NULL) return ncclSuccess;
 
+  // Extend the previous op on that connector if both run the same way. Steps
+  // of an op start at a multiple of chunkSteps, and nsteps is a multiple of
+  // chunkSteps, so the merged op goes through the same steps.
+  struct ncclProxyArgs* last = connector->proxyStaged;
+  if (last && ncclParamProxyCoalesce() &&
+      last->protocol == args->protocol && last->sliceSteps == args->sliceSteps && last->chunkSteps == args->chunkSteps &&
+      last->dtype == args->dtype && last->redOp == args->redOp && last->nsteps % last->chunkSteps == 0) {
+    last->nsteps += args->nsteps;
+    return ncclSuccess;
+  }
+
+  struct ncclComm* comm = connector->comm;
+  struct ncclProxyState* state = comm->proxyState+comm->channelProxy[args->channel->id];
   struct ncclProxyArgs* op;
-  NCCLCHECK(transportAllocateProxyArgs(connector->comm, &op));
+  NCCLCHECK(transportAllocateProxyArgs(state, &op));
   memcpy(op, args, sizeof(struct ncclProxyArgs));
   op->connector = connector;
   op->progress = connector->transportComm->proxy;
   op->state = ncclProxyOpReady;
-  ProxyAppend(connector, op);
+  // Keep the op until the launch, in case the next ones can be merged into it
+  op->next = state->staged;
+  if (state->staged == NULL) state->stagedLast = op;
+  state->staged = op;
+  connector->proxyStaged = op;
   return ncclSuccess;
 }
 
@@ -146,42 +244,170 @@ ncclResult_t transportSaveProxies(struct ncclProxyArgs* args, int pattern, int r
   return ncclSuccess;
 }
 
-void* persistentThread(void *comm_) {
-  struct ncclComm* comm = (struct ncclComm*)comm_;
-  struct ncclProxyState* state = &comm->proxyState;
-  struct ncclProxyArgs* op = NULL;
-  ncclResult_t ret = ncclSuccess;
-  int idle = 1;
-  int idleSpin = 0;
-  while (1) {
-    do {
-      if (*comm->abortFlag) return NULL;
-      if (op == NULL) {
-        pthread_mutex_lock(&state->mutex);
-        op = state->ops;
-        if (op == NULL) {
-          if (state->stop) {
-            // No more commands to process and proxy has been requested to stop
-            pthread_mutex_unlock(&state->mutex);
-            return NULL;
-          }
-          pthread_cond_wait(&state->cond, &state->mutex);
+static long proxyFutex(volatile int* addr, int op, int val, const struct timespec* timeout) {
+  return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static inline void proxyPause() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// Whether something happened which the proxy thread has to handle
+static int proxyPending(struct ncclProxyThread* thread) {
+  if (thread->stop || thread->attach) return 1;
+  for (struct ncclProxyState* state = thread->states; state; state = state->next) {
+    if (state->incoming || state->detach) return 1;
+  }
+  return 0;
+}
+
+// Sleep until woken up, or for at most timeoutUs if timeoutUs >= 0.
+static void proxySleep(struct ncclProxyThread* thread, int timeoutUs) {
+  thread->sleeping = 1;
+  __sync_synchronize();
+  int seq = thread->wakeSeq;
+  // Work posted before sleeping was set did not trigger a wake-up
+  if (proxyPending(thread) == 0) {
+    struct timespec ts = { timeoutUs / 1000000, (timeoutUs % 1000000) * 1000L };
+    double start = ncclTimeUs();
+    proxyFutex(&thread->wakeSeq, FUTEX_WAIT_PRIVATE, seq, timeoutUs >= 0 ? &ts : NULL);
+    double end = ncclTimeUs();
+    thread->sleepTime += end-start;
+    thread->sleeps++;
+    if (timeoutUs >= 0) thread->timedSleeps++;
+    double wakeTime = thread->wakeTime;
+    if (thread->wakeSeq != seq && wakeTime >= start) {
+      thread->wakeUps++;
+      thread->wakeLatency += end-wakeTime;
+      thread->maxWakeLatency = std::max(thread->maxWakeLatency, end-wakeTime);
+    }
+  }
+  thread->sleeping = 0;
+}
+
+static void proxyWake(struct ncclProxyThread* thread) {
+  __sync_synchronize();
+  if (thread->sleeping == 0) return;
+  thread->wakeTime = ncclTimeUs();
+  __sync_fetch_and_add(&thread->wakeSeq, 1);
+  proxyFutex(&thread->wakeSeq, FUTEX_WAKE_PRIVATE, 1, NULL);
+  __sync_fetch_and_add(&thread->wakes, 1);
+}
+
+#define PROXY_MIN_SLEEP_US 4
+
+// Called after each pass during which all ops were idle. Ops can be waiting
+// for the GPU or the network, neither of which can wake us up, so we go
+// from spinning to yielding to sleeping for longer and longer periods.
+static void proxyBackoff(struct ncclProxyThread* thread, double* idleStart, int* sleepUs) {
+  double now = ncclTimeUs();
+  if (*idleStart == 0) {
+    *idleStart = now;
+    *sleepUs = PROXY_MIN_SLEEP_US;
+  }
+  double idleTime = now-*idleStart;
+  if (idleTime < thread->spinUs) {
+    proxyPause();
+  } else if (idleTime < thread->yieldUs || thread->maxSleepUs == 0) {
+    sched_yield();
+    thread->yields++;
+  } else {
+    proxySleep(thread, *sleepUs);
+    *sleepUs = std::min(2*(*sleepUs), thread->maxSleepUs);
+  }
+}
+
+// Record how long an op took, from the time the proxy thread picked it up
+static void proxyRecordLatency(struct ncclProxyState* state, struct ncclProxyArgs* op) {
+  double us = ncclTimeUs() - op->readyTime;
+  int b = 0;
+  while (b < NCCL_PROXY_LATENCY_BUCKETS-1 && us >= (double)(1<<b)) b++;
+  state->latency[op->protocol][b]++;
+}
+
+static void proxyTraceEvent(struct ncclProxyState* state, struct ncclProxyArgs* op, int type, uint64_t step) {
+  struct ncclProxyTraceEvent* event = ncclProxyTraceNext(state->thread->trace);
+  struct ncclPeer* peers = op->channel->peers;
+  int peer = ((char*)op->connector - (char*)peers) / sizeof(struct ncclPeer);
+  event->time = ncclTimeUs();
+  event->opCount = op->opCount;
+  event->step = step;
+  event->comm = state->traceId;
+  event->rank = state->comm->rank;
+  event->peer = peer;
+  event->channel = op->channel->id;
+  event->type = type;
+  event->send = op->connector == &peers[peer].send;
+  event->protocol = op->protocol;
+}
+
+// Progress a traced op. Transports set head, tail and end when they start
+// an op : steps up to tail are posted to the network, and steps up to head
+// are complete.
+static ncclResult_t proxyProgressTraced(struct ncclProxyState* state, struct ncclProxyArgs* op) {
+  int opState = op->state;
+  uint64_t head = op->head, tail = op->tail;
+  NCCLCHECK(op->progress(op));
+  if (op->state == ncclProxyOpReady) return ncclSuccess;
+  uint64_t start = op->end - op->nsteps;
+  if (opState == ncclProxyOpReady) {
+    head = tail = start;
+    proxyTraceEvent(state, op, ncclProxyTraceReady, op->nsteps);
+  }
+  if (tail == start && op->tail > tail) proxyTraceEvent(state, op, ncclProxyTracePosted, 0);
+  if (op->head > head) proxyTraceEvent(state, op, ncclProxyTraceStep, op->head - start);
+  if (op->state == ncclProxyOpNone) proxyTraceEvent(state, op, ncclProxyTraceDone, op->nsteps);
+  return ncclSuccess;
+}
+
+static ncclResult_t proxyProgressOp(struct ncclProxyState* state, struct ncclProxyArgs* op, int* idle) {
+  op->idle = 0;
+  // opCount >= lastOpCount are part of an ongoing GroupStart/GroupEnd that hasn't started
+  // yet and might be cancelled before they even start. Hold on on those.
+  if (op->state != ncclProxyOpNone && op->opCount < state->comm->lastOpCount) {
+    if (op->traced) {
+      NCCLCHECK(proxyProgressTraced(state, op));
+    } else {
+      NCCLCHECK(op->progress(op));
+    }
+    if (op->state == ncclProxyOpNone && state->histograms) proxyRecordLatency(state, op);
+  }
+  *idle &= op->idle;
+  return ncclSuccess;
+}
+
+// Progress each op of a proxy state once. Clears idle if any op was busy.
+// The most urgent ops are progressed again every NCCL_PROXY_PRIORITY ops,
+// so that they do not wait for a whole pass over bulk transfers.
+static ncclResult_t proxyPass(struct ncclProxyState* state, int* idle) {
+  struct ncclComm* comm = state->comm;
+  ProxyAppendIncoming(state);
+  struct ncclProxyArgs* urgent[NCCL_PROXY_MAX_URGENT];
+  int nUrgent = 0, minRank = INT_MAX, maxRank = -1, calls = 0;
+  struct ncclProxyArgs* op = state->ops;
+  while (op) {
+    NCCLCHECK(proxyProgressOp(state, op, idle));
+    if (state->priority) {
+      if (op->state != ncclProxyOpNone && op->opCount < comm->lastOpCount) {
+        int rank = proxyOpRank(op);
+        if (rank < minRank) {
+          minRank = rank;
+          nUrgent = 0;
+        }
+        if (rank == minRank && nUrgent < NCCL_PROXY_MAX_URGENT) urgent[nUrgent++] = op;
+        maxRank = std::max(maxRank, rank);
+      }
+      if (state->nUrgent && ++calls % state->priority == 0) {
+        for (int u=0; u<state->nUrgent; u++) {
+          struct ncclProxyArgs* urgentOp = state->urgent[u];
+          if (urgentOp != op && urgentOp->state != ncclProxyOpNone) NCCLCHECK(proxyProgressOp(state, urgentOp, idle));
         }
-        pthread_mutex_unlock(&state->mutex);
       }
-    } while (op == NULL);
-    op->idle = 0;
-    // opCount >= lastOpCount are part of an ongoing GroupStart/GroupEnd that hasn't started
-    // yet and might be cancelled before they even start. Hold on on those.
-    if (op->state != ncclProxyOpNone && op->opCount < comm->lastOpCount) ret = op->progress(op);
-    if (ret != ncclSuccess) {
-      comm->fatalError = ret;
-      INFO(NCCL_ALL,"%s:%d -> %d [Proxy Thread]", __FILE__, __LINE__, ret);
-      return NULL;
     }
-    idle &= op->idle;
-    pthread_mutex_lock(&state->mutex);
-    if (!idle) idleSpin = 0;
     struct ncclProxyArgs *next = op->next;
     if (next->state == ncclProxyOpNone) {
       struct ncclProxyArgs *freeOp = next;
@@ -205,60 +431,391 @@ void* persistentThread(void *comm_) {
         }
       }
       if (freeOp == state->ops) state->ops = next;
-      freeOp->next = state->pool;
-      state->pool = freeOp;
+      proxyDropUrgent(state->urgent, &state->nUrgent, freeOp);
+      proxyDropUrgent(urgent, &nUrgent, freeOp);
+      proxyPush(&state->freeOps, freeOp);
     }
     op = next;
-    if (op == state->ops) {
-      if (idle == 1) {
-        if (++idleSpin == 10) {
-          sched_yield();
-          idleSpin = 0;
+    if (op == state->ops) break;
+  }
+  // Only favor some ops if they rank better than others
+  state->maxRank = maxRank;
+  state->nUrgent = 0;
+  state->urgentRank = INT_MAX;
+  if (minRank < maxRank) {
+    for (int u=0; u<nUrgent; u++) proxyAddUrgent(state, urgent[u], minRank);
+  }
+  return ncclSuccess;
+}
+
+static void proxyProgress(struct ncclProxyThread* thread) {
+  double idleStart = 0;
+  int sleepUs = 0;
+  while (1) {
+    struct ncclProxyTrace* trace = thread->trace;
+    if (trace && trace->dumpSeq != ncclProxyTraceDumpSeq) {
+      trace->dumpSeq = ncclProxyTraceDumpSeq;
+      ncclProxyTraceDump(trace);
+    }
+
+    // Pick up new states
+    struct ncclProxyState* attach = thread->attach ? __sync_lock_test_and_set(&thread->attach, (struct ncclProxyState*)NULL) : NULL;
+    while (attach) {
+      struct ncclProxyState* next = attach->next;
+      attach->next = thread->states;
+      thread->states = attach;
+      attach = next;
+    }
+
+    // One pass on the ops of each state. States of aborted or failed
+    // communicators are left alone until they are detached.
+    int active = 0, idle = 1;
+    struct ncclProxyState** statePtr = &thread->states;
+    struct ncclProxyState* state;
+    while ((state = *statePtr) != NULL) {
+      struct ncclComm* comm = state->comm;
+      if (state->error == ncclSuccess && *comm->abortFlag == 0) {
+        ncclResult_t ret = proxyPass(state, &idle);
+        if (ret != ncclSuccess) {
+          state->error = comm->fatalError = ret;
+          INFO(NCCL_ALL,"%s:%d -> %d [Proxy Thread]", __FILE__, __LINE__, ret);
         }
       }
-      idle = 1;
+      int stopped = state->error != ncclSuccess || *comm->abortFlag;
+      if (state->detach && (stopped || (state->ops == NULL && state->incoming == NULL))) {
+        // The communicator may free the state as soon as detached is set
+        *statePtr = state->next;
+        __sync_synchronize();
+        state->detached = 1;
+        continue;
+      }
+      if (!stopped && state->ops) active = 1;
+      statePtr = &state->next;
+    }
+
+    if (active && idle) {
+      proxyBackoff(thread, &idleStart, &sleepUs);
+      continue;
+    }
+    if (idleStart != 0) thread->idleTime += ncclTimeUs()-idleStart;
+    idleStart = 0;
+    if (active == 0) {
+      // No more states to serve and proxy has been requested to stop
+      if (thread->stop && thread->states == NULL) return;
+      proxySleep(thread, -1);
     }
-    pthread_mutex_unlock(&state->mutex);
   }
 }
 
+void* persistentThread(void *thread_) {
+  struct ncclProxyThread* thread = (struct ncclProxyThread*)thread_;
+  if (CPU_COUNT(&thread->cpuset)) sched_setaffinity(0, sizeof(cpu_set_t), &thread->cpuset);
+  proxyProgress(thread);
+
+  // Report how much CPU the proxy used and how quickly it woke up, to help tuning
+  // NCCL_PROXY_SPIN_US, NCCL_PROXY_YIELD_US and NCCL_PROXY_MAX_SLEEP_US
+  struct timespec cpu;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+  double total = std::max(ncclTimeUs()-thread->startTime, 1.0);
+  INFO(NCCL_INIT, "Proxy thread %s : cpu %.1f%% over %.1f ms, all ops idle %.1f%%, asleep %.1f%% ; %lu sleeps (%lu timed), %lu yields ; %lu wake-ups sent, latency avg %.1f us max %.1f us",
+      thread->name, (cpu.tv_sec*1e6+cpu.tv_nsec*1e-3)*100/total, total*1e-3, thread->idleTime*100/total, thread->sleepTime*100/total,
+      thread->sleeps, thread->timedSleeps, thread->yields, thread->wakes, thread->wakeUps ? thread->wakeLatency/thread->wakeUps : 0.0, thread->maxWakeLatency);
+  if (thread->trace) ncclProxyTraceDump(thread->trace);
+  return NULL;
+}
+
 ncclResult_t transportStartProxy(struct ncclComm* comm) {
-  pthread_mutex_lock(&comm->proxyState.mutex);
-  if (comm->proxyState.ops != NULL)
-    pthread_cond_signal(&comm->proxyState.cond);
-  pthread_mutex_unlock(&comm->proxyState.mutex);
+  for (int t=0; t<comm->nProxyStates; t++) {
+    struct ncclProxyState* state = comm->proxyState+t;
+    struct ncclProxyArgs* staged = state->staged;
+    if (staged) {
+      // Hand the ops saved since the last launch over to the proxy thread
+      for (struct ncclProxyArgs* op = staged; op; op = op->next) op->connector->proxyStaged = NULL;
+      state->staged = NULL;
+      struct ncclProxyArgs* top;
+      do {
+        top = state->incoming;
+        state->stagedLast->next = top;
+      } while (__sync_bool_compare_and_swap(&state->incoming, top, staged) == false);
+    }
+    // New ops may have become ready even if they were already handed over
+    proxyWake(state->thread);
+  }
+  return ncclSuccess;
+}
+
+// Drop the ops saved for a GroupStart/GroupEnd which never started. They
+// were not handed over to the proxy thread yet.
+ncclResult_t transportCancelProxy(struct ncclComm* comm) {
+  for (int t=0; t<comm->nProxyStates; t++) {
+    struct ncclProxyState* state = comm->proxyState+t;
+    if (state->staged == NULL) continue;
+    for (struct ncclProxyArgs* op = state->staged; op; op = op->next) {
+      op->connector->proxyStaged = NULL;
+      op->state = ncclProxyOpNone;
+    }
+    state->stagedLast->next = state->pool;
+    state->pool = state->staged;
+    state->staged = NULL;
+  }
   return ncclSuccess;
 }
 
-ncclResult_t transportCreateProxy(struct ncclComm* comm) {
-  if (!comm->proxyThread) {
-    comm->proxyState.cond = PTHREAD_COND_INITIALIZER;
-    comm->proxyState.mutex = PTHREAD_MUTEX_INITIALIZER;
-    comm->proxyState.ops = NULL;
-    pthread_create(&comm->proxyThread, NULL, persistentThread, comm);
+NCCL_PARAM(ProxyNthreads, "PROXY_NTHREADS", -2);
+NCCL_PARAM(ProxyShared, "PROXY_SHARED", 0);
+NCCL_PARAM(ProxySpinUs, "PROXY_SPIN_US", 20);
+NCCL_PARAM(ProxyYieldUs, "PROXY_YIELD_US", 200);
+NCCL_PARAM(ProxyMaxSleepUs, "PROXY_MAX_SLEEP_US", 64);
+NCCL_PARAM(ProxyPriority, "PROXY_PRIORITY", 4);
+NCCL_PARAM(ProxyHistograms, "PROXY_HISTOGRAMS", 0);
+
+#define PROXY_SHARED_NONE 0
+#define PROXY_SHARED_PROCESS 1
+#define PROXY_SHARED_NIC 2
+#define PROXY_KEY_PROCESS -2
+
+// Shared proxy threads, by key
+static pthread_mutex_t proxySharedLock = PTHREAD_MUTEX_INITIALIZER;
+static struct ncclProxyThread* proxySharedThreads = NULL;
+
+static ncclResult_t proxyThreadCreate(const char* name, cpu_set_t* cpuset, struct ncclProxyThread** threadPtr) {
+  struct ncclProxyThread* thread;
+  NCCLCHECK(ncclCalloc(&thread, 1));
+  strncpy(thread->name, name, sizeof(thread->name)-1);
+  thread->cpuset = *cpuset;
+  thread->spinUs = std::max((int)ncclParamProxySpinUs(), 0);
+  thread->yieldUs = std::max((int)ncclParamProxyYieldUs(), thread->spinUs);
+  thread->maxSleepUs = std::max((int)ncclParamProxyMaxSleepUs(), 0);
+  thread->startTime = ncclTimeUs();
+  thread->refCount = 1;
+  if (ncclProxyTraceCreate(&thread->trace) != ncclSuccess) {
+    free(thread);
+    return ncclSystemError;
   }
+  int err = pthread_create(&thread->thread, NULL, persistentThread, thread);
+  if (err != 0) {
+    WARN("Unable to create proxy thread : %s", strerror(err));
+    ncclProxyTraceFree(thread->trace);
+    free(thread);
+    return ncclSystemError;
+  }
+  *threadPtr = thread;
   return ncclSuccess;
 }
 
-ncclResult_t transportDestroyProxy(struct ncclComm* comm) {
-  struct ncclProxyState* state = &comm->proxyState;
+// Get a shared proxy thread, creating it if needed
+static ncclResult_t proxySharedThreadGet(int key, cpu_set_t* cpuset, struct ncclProxyThread** threadPtr) {
+  ncclResult_t ret = ncclSuccess;
+  pthread_mutex_lock(&proxySharedLock);
+  struct ncclProxyThread* thread = proxySharedThreads;
+  while (thread && thread->key != key) thread = thread->next;
+  if (thread) {
+    thread->refCount++;
+  } else {
+    char name[64];
+    if (key == PROXY_KEY_PROCESS) snprintf(name, sizeof(name), "shared");
+    else if (key == -1) snprintf(name, sizeof(name), "shared, no network");
+    else snprintf(name, sizeof(name), "shared NET/%d", key);
+    ret = proxyThreadCreate(name, cpuset, &thread);
+    if (ret == ncclSuccess) {
+      thread->key = key;
+      thread->next = proxySharedThreads;
+      proxySharedThreads = thread;
+    }
+  }
+  pthread_mutex_unlock(&proxySharedLock);
+  *threadPtr = thread;
+  return ret;
+}
 
+// Drop a reference to a proxy thread, and stop it if it was the last one
+static void proxyThreadRelease(struct ncclProxyThread* thread) {
+  pthread_mutex_lock(&proxySharedLock);
+  int last = --thread->refCount == 0;
+  if (last) {
+    // Remove the thread from the shared list, if it is there
+    struct ncclProxyThread** ptr = &proxySharedThreads;
+    while (*ptr && *ptr != thread) ptr = &(*ptr)->next;
+    if (*ptr) *ptr = thread->next;
+  }
+  pthread_mutex_unlock(&proxySharedLock);
+  if (!last) return;
   // Request the proxy to stop and then wake it
-  pthread_mutex_lock(&state->mutex);
-  state->stop = true;
-  pthread_cond_signal(&state->cond);
-  pthread_mutex_unlock(&state->mutex);
-  if (comm->proxyThread) pthread_join(comm->proxyThread, NULL);
-
-  // Free off any memory allocated for the proxy arg pools
-  pthread_mutex_lock(&state->mutex);
-  struct ncclProxyState* proxyState = &comm->proxyState;
-  while (proxyState->pools != NULL) {
-    struct ncclProxyPool *next = proxyState->pools->next;
-    free(proxyState->pools);
-    proxyState->pools = next;
-  }
-  pthread_mutex_unlock(&state->mutex);
+  thread->stop = 1;
+  proxyWake(thread);
+  pthread_join(thread->thread, NULL);
+  ncclProxyTraceFree(thread->trace);
+  free(thread);
+}
 
+// Split channels between proxy states according to the NIC they use.
+// By default each NIC gets its own state and thread. With fewer threads
+// than NICs, threads serve several NICs ; with more, the channels of a NIC
+// are spread over the threads serving it. Shared proxies use one state per
+// NIC, or a single one.
+static ncclResult_t proxySetupStates(struct ncclComm* comm, struct ncclTopoGraph* graph, int shared, int* keys, int* numaIds, cpu_set_t* cpusets) {
+  int netDevs[MAXCHANNELS];
+  int nets[MAXCHANNELS];
+  int nNets = 0;
+  for (int c=0; c<comm->nChannels; c++) {
+    netDevs[c] = -1;
+    if (comm->nNodes > 1 && graph->nChannels > 0) NCCLCHECK(ncclTopoGetNetDev(comm->topo, graph, comm->rank, c, netDevs+c));
+    int n = 0;
+    while (n < nNets && nets[n] != netDevs[c]) n++;
+    if (n == nNets) nets[nNets++] = netDevs[c];
+  }
+  int nStates = shared == PROXY_SHARED_PROCESS ? 1 : shared == PROXY_SHARED_NIC ? nNets : ncclParamProxyNthreads();
+  if (nStates == -2) nStates = nNets; // One thread per NIC
+  nStates = std::max(1, std::min(std::min(nStates, NCCL_PROXY_MAX_THREADS), std::max(comm->nChannels, 1)));
+
+  // Channels already given to each NIC, to spread them over its threads
+  int netChannels[MAXCHANNELS] = { 0 };
+  for (int c=0; c<comm->nChannels; c++) {
+    int n = 0;
+    while (nets[n] != netDevs[c]) n++;
+    if (nStates <= nNets) {
+      comm->channelProxy[c] = n % nStates;
+    } else {
+      // Threads n, n+nNets, n+2*nNets, ... serve NIC n
+      int netThreads = (nStates - n + nNets - 1) / nNets;
+      comm->channelProxy[c] = n + (netChannels[n]++ % netThreads) * nNets;
+    }
+  }
+
+  cpu_set_t allowed;
+  SYSCHECK(sched_getaffinity(0, sizeof(cpu_set_t), &allowed), "sched_getaffinity");
+  for (int t=0; t<nStates; t++) {
+    keys[t] = shared == PROXY_SHARED_NIC ? nets[t] : PROXY_KEY_PROCESS;
+    numaIds[t] = -1;
+    CPU_ZERO(cpusets+t);
+    char line[1024];
+    int offset = 0;
+    line[0] = '\0';
+    for (int n=t%nNets; n<nNets; n+=nStates) {
+      if (nets[n] == -1) continue;
+      int numaId;
+      cpu_set_t netMask;
+      NCCLCHECK(ncclTopoGetNetAffinity(comm->topo, nets[n], &numaId, &netMask));
+      if (numaIds[t] == -1) numaIds[t] = numaId;
+      CPU_OR(cpusets+t, cpusets+t, &netMask);
+      offset += snprintf(line+offset, sizeof(line)-offset, " NET/%d", nets[n]);
+    }
+    CPU_AND(cpusets+t, cpusets+t, &allowed);
+    char affinityStr[sizeof(cpu_set_t)*2];
+    NCCLCHECK(ncclCpusetToStr(cpusets+t, affinityStr));
+    INFO(NCCL_INIT, "Proxy %s %d/%d :%s, affinity %s", shared ? "shared thread" : "thread", t, nStates, offset ? line : " no network",
+        CPU_COUNT(cpusets+t) ? affinityStr : "unchanged");
+  }
+  comm->nProxyStates = nStates;
+  return ncclSuccess;
+}
+
+ncclResult_t transportCreateProxy(struct ncclComm* comm, struct ncclTopoGraph* graph) {
+  if (comm->nProxyStates) return ncclSuccess;
+  int shared = ncclParamProxyShared();
+  int keys[NCCL_PROXY_MAX_THREADS];
+  int numaIds[NCCL_PROXY_MAX_THREADS];
+  cpu_set_t cpusets[NCCL_PROXY_MAX_THREADS];
+  NCCLCHECK(proxySetupStates(comm, graph, shared, keys, numaIds, cpusets));
+  int nStates = comm->nProxyStates;
+  comm->nProxyStates = 0;
+  static int proxyTraceIds = 0;
+  int traceId = __sync_fetch_and_add(&proxyTraceIds, 1);
+  for (int t=0; t<nStates; t++) {
+    struct ncclProxyState* state = comm->proxyState+t;
+    state->comm = comm;
+    state->traceId = traceId;
+    state->ops = NULL;
+    state->incoming = NULL;
+    state->staged = NULL;
+    state->freeOps = NULL;
+    state->detach = state->detached = 0;
+    state->error = ncclSuccess;
+    state->priority = std::max(0L, ncclParamProxyPriority());
+    state->nUrgent = 0;
+    state->urgentRank = INT_MAX;
+    state->maxRank = -1;
+    state->histograms = ncclParamProxyHistograms();
+    memset(state->latency, 0, sizeof(state->latency));
+    char arenaName[32];
+    snprintf(arenaName, sizeof(arenaName), "proxy %d/%d", t, nStates);
+    ncclArenaInit(&state->arena, arenaName, numaIds[t]);
+    if (shared) {
+      NCCLCHECK(proxySharedThreadGet(keys[t], cpusets+t, &state->thread));
+    } else {
+      char name[64];
+      snprintf(name, sizeof(name), "%d/%d of comm %p", t, nStates, comm);
+      NCCLCHECK(proxyThreadCreate(name, cpusets+t, &state->thread));
+    }
+    comm->nProxyStates = t+1;
+    // Hand the state over to the thread
+    struct ncclProxyThread* thread = state->thread;
+    do {
+      state->next = thread->attach;
+    } while (__sync_bool_compare_and_swap(&thread->attach, state->next, state) == false);
+    proxyWake(thread);
+  }
+  return ncclSuccess;
+}
+
+static const char* proxyProtoStr[] = { "LL", "LL128", "Simple" };
+
+// Bucket b holds latencies below 2^b us, the last one those of 2^(b-1) us or more
+static void proxyBucketStr(int b, char* str, int size) {
+  if (b == NCCL_PROXY_LATENCY_BUCKETS-1) snprintf(str, size, ">= %d", 1<<(b-1));
+  else snprintf(str, size, "< %d", 1<<b);
+}
+
+static void proxyReportLatency(struct ncclProxyState* state, int t, int nStates) {
+  for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+    uint64_t* latency = state->latency[p];
+    uint64_t count = 0;
+    for (int b=0; b<NCCL_PROXY_LATENCY_BUCKETS; b++) count += latency[b];
+    if (count == 0) continue;
+    // Buckets hold latencies below 1, 2, 4, ... us, the last one the rest
+    char line[1024];
+    int offset = 0;
+    uint64_t sum = 0;
+    int p50 = -1, p99 = -1;
+    for (int b=0; b<NCCL_PROXY_LATENCY_BUCKETS; b++) {
+      sum += latency[b];
+      if (p50 == -1 && sum*2 >= count) p50 = b;
+      if (p99 == -1 && sum*100 >= count*99) p99 = b;
+      if (latency[b] == 0) continue;
+      if (b == NCCL_PROXY_LATENCY_BUCKETS-1) {
+        offset += snprintf(line+offset, sizeof(line)-offset, " >=%d:%lu", 1<<(b-1), latency[b]);
+      } else {
+        offset += snprintf(line+offset, sizeof(line)-offset, " <%d:%lu", 1<<b, latency[b]);
+      }
+    }
+    char p50Str[16], p99Str[16];
+    proxyBucketStr(p50, p50Str, sizeof(p50Str));
+    proxyBucketStr(p99, p99Str, sizeof(p99Str));
+    INFO(NCCL_INIT, "Proxy %d/%d of comm %p : %s op latency (us) p50 %s, p99 %s over %lu ops ;%s",
+        t, nStates, state->comm, proxyProtoStr[p], p50Str, p99Str, count, line);
+  }
+}
+
+ncclResult_t transportDestroyProxy(struct ncclComm* comm) {
+  for (int t=0; t<comm->nProxyStates; t++) {
+    struct ncclProxyState* state = comm->proxyState+t;
+
+    // Wait for the proxy thread to complete our ops and drop the state
+    state->detach = 1;
+    proxyWake(state->thread);
+    while (state->detached == 0) sched_yield();
+    proxyThreadRelease(state->thread);
+    if (state->histograms) proxyReportLatency(state, t, comm->nProxyStates);
+  }
+  comm->nProxyStates = 0;
+  return ncclSuccess;
+}
+
+// Called once the transports have freed the connections, as their resources
+// live in the arenas too.
+ncclResult_t transportFreeProxyResources(struct ncclComm* comm) {
+  for (int t=0; t<NCCL_PROXY_MAX_THREADS; t++) {
+    NCCLCHECK(ncclArenaRelease(&comm->proxyState[t].arena));
+  }
   return ncclSuccess;
 }
@@ -57,7 +57,7 @@ ncclResult_t netCanConnect(int* ret, struct ncclTopoSystem* topo, struct ncclTop
  * information for this peer */
 ncclResult_t netSendSetup(struct ncclTopoSystem* topo, struct ncclTopoGraph* graph, struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo, struct ncclConnect* connectInfo, struct ncclConnector* send, int buffSize, int channelId) {
   struct netSendResources* resources;
-  NCCLCHECK(ncclCalloc(&resources, 1));
+  NCCLCHECK(transportAllocateProxyResources(send, channelId, sizeof(struct netSendResources), (void**)&resources));
   send->transportResources = resources;
 
   NCCLCHECK(ncclTopoGetNetDev(topo, graph, myInfo->rank, channelId, &resources->netDev));
@@ -80,7 +80,7 @@ ncclResult_t netSendSetup(struct ncclTopoSystem* topo, struct ncclTopoGraph* gra
 
 ncclResult_t netRecvSetup(struct ncclTopoSystem* topo, struct ncclTopoGraph* graph, struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo, struct ncclConnect* connectInfo, struct ncclConnector* recv, int buffSize, int channelId) {
   struct netRecvResources* resources;
-  NCCLCHECK(ncclCalloc(&resources, 1));
+  NCCLCHECK(transportAllocateProxyResources(recv, channelId, sizeof(struct netRecvResources), (void**)&resources));
   recv->transportResources = resources;
 
   NCCLCHECK(ncclTopoGetNetDev(topo, graph, myInfo->rank, channelId, &resources->netDev));
@@ -178,7 +178,6 @@ ncclResult_t netSendFree(void* transportResources) {
   if (resources->useGdr)
     CUDACHECK(cudaFree(resources->devRecvMem));
   NCCLCHECK(ncclNetCloseSend(resources->netSendComm));
-  free(resources);
   return ncclSuccess;
 }
 
@@ -192,7 +191,6 @@ ncclResult_t netRecvFree(void* transportResources) {
   if (resources->useGdr)
     CUDACHECK(cudaFree(resources->devRecvMem));
   NCCLCHECK(ncclNetCloseRecv(resources->netRecvComm));
-  free(resources);
   return ncclSuccess;
 }
 
@@ -9,6 +9,9 @@
 #include "socket.h"
 #include "net.h"
 #include "param.h"
+#include "uring.h"
+#include "cpuset.h"
+#include "codec.h"
 
 #include <assert.h>
 #include <pthread.h>
@@ -17,6 +20,11 @@
 #include <poll.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/errqueue.h>
 
 /* Init functions */
 static int ncclNetIfs = -1;
@@ -96,6 +104,8 @@ ncclResult_t ncclSocketGetProperties(int dev, ncclNetProperties_t* props) {
   props->pciPath = ncclSocketDevs[dev].pciPath;
   props->guid = dev;
   props->ptrSupport = NCCL_PTR_HOST;
+  // Bonded interfaces only carry extra data sockets. Each device reports its
+  // own speed, otherwise the topology would count the same links several times.
   NCCLCHECK(ncclSocketGetSpeed(props->name, &props->speed));
   props->port = 0;
   props->maxComms = 65536;
@@ -112,27 +122,93 @@ ncclResult_t GetSocketAddr(int dev, union socketAddress* addr) {
 
 #define MAX_SOCKETS 64
 #define MAX_THREADS 16
-#define MAX_REQUESTS 128
-#define MAX_QUEUE_LEN MAX_REQUESTS
+#define MAX_REQUESTS 1024
+#define REQUEST_CHUNK 32
+#define TASK_CHUNK 64
+#define MAX_QUEUE_LEN 128
 #define MIN_CHUNKSIZE (64*1024)
+#define MAX_INLINE_SIZE (64*1024)
+#define CTRL_BUF_SIZE (16*1024)
+#define MAX_CTRL_BATCH 16
+#define MAX_FRAME_SIZE (512*1024)
 
 NCCL_PARAM(SocketNsocksPerThread, "NSOCKS_PERTHREAD", -2);
 NCCL_PARAM(SocketNthreads, "SOCKET_NTHREADS", -2);
+NCCL_PARAM(SocketUring, "SOCKET_URING", 0);
+NCCL_PARAM(SocketZeroCopyThreshold, "SOCKET_ZEROCOPY_THRESHOLD", 0);
+NCCL_PARAM(SocketBond, "SOCKET_BOND", 0);
+NCCL_PARAM(SocketSpinUs, "SOCKET_SPIN_US", 0);
+NCCL_PARAM(SocketBusyPoll, "SOCKET_BUSY_POLL", 0);
+
+/* With NCCL_SOCKET_BOND=1, the listener also listens on the other IPv4
+ * interfaces and data sockets are spread over all of them, so that a
+ * connection can use several NICs. Addresses are kept compact to fit in
+ * the handle.
+ */
+#define MAX_BOND_IFS 4
+struct ncclSocketBondAddr {
+  uint32_t addr; // Network byte order
+  uint16_t port; // Network byte order
+};
 
 struct ncclSocketHandle {
   union socketAddress connectAddr;
-  int nSocks;
-  int nThreads;
+  int16_t nSocks;
+  uint8_t nBondAddrs;
+  uint8_t codecs; // Mask of the codecs the listener can decode
+  struct ncclSocketBondAddr bondAddrs[MAX_BOND_IFS-1];
 };
 
+/* MSG_ZEROCOPY state of a data socket. Each successful zero-copy send gets
+ * the next sequence number on that socket, and the kernel reports ranges of
+ * completed sequence numbers on the socket error queue once it no longer
+ * needs the user buffer.
+ */
+#define ZC_MAX_PENDING 1024
+struct ncclSocketZcSock {
+  int fd;
+  uint32_t nextSeq; // Sequence number of the next zero-copy send
+  uint32_t doneSeq; // All zero-copy sends before doneSeq have completed
+  int bytes[ZC_MAX_PENDING];
+  char done[ZC_MAX_PENDING];
+};
+
+struct ncclSocketRequest;
+
+/* Payloads split over data sockets are sent as frames, each with a header
+ * giving the part of the message it carries. A task serves one request on
+ * one socket : it sends frames until there is nothing left to send, then an
+ * empty frame so that the receiver knows the socket is done with the request.
+ *
+ * With NCCL_SOCKET_CODEC, frame payloads are encoded when that makes them
+ * smaller. Encoded payloads go through a per-socket staging buffer.
+ */
+struct ncclSocketFrame {
+  int offset;
+  int size; // 0 terminates the request on this socket
+  int wireSize; // Size of the payload on the wire
+  int codec;
+};
+
+enum ncclSocketTaskState { taskStart, taskHeader, taskPayload, taskDone };
+
 struct ncclSocketTask {
   int op;
-  void* data;
+  void* data; // Current segment, either the frame header or its payload
   int size;
   int fd;
   int offset;
-  int used;
+  int sub; // Index of the task in the request
+  int sockIdx;
+  enum ncclSocketTaskState state;
+  struct ncclSocketFrame frame;
   ncclResult_t result;
+  struct ncclSocketRequest* req;
+  struct ncclSocketZcSock* zc; // Non-NULL while a zero-copy send is not complete
+  uint32_t zcEnd;
+  int bytes; // Payload sent by this task
+  uint64_t startTime;
+  struct ncclSocketTask* next; // Free list
 };
 
 struct ncclSocketRequest {
@@ -144,100 +220,1061 @@ struct ncclSocketRequest {
   int used;
   struct ncclSocketComm* comm;
   struct ncclSocketTask* tasks[MAX_SOCKETS];
+  // Part of the payload not yet claimed by each send task, as start << 32 | end
+  volatile uint64_t ranges[MAX_SOCKETS];
+  volatile uint64_t started; // Mask of send tasks which started sending
   int nSubs;
+  int nCompleted; // Incremented by helper threads each time a subtask is done
+  int sock; // Data socket of the first subtask
+  int posted; // Subtasks were posted to their sockets
+  struct ncclSocketRequest* next; // Free list or post queue
 };
 
-struct ncclSocketTaskQueue {
-  int next;
-  struct ncclSocketTask* tasks;
+/* Requests and tasks are allocated in chunks when the free lists run dry, and
+ * recycled through these lists. Only the thread calling isend/irecv/test
+ * touches them, so they need no locking.
+ */
+struct ncclSocketRequestChunk {
+  struct ncclSocketRequestChunk* next;
+  struct ncclSocketRequest requests[REQUEST_CHUNK];
 };
 
-enum threadState {start, stop};
+struct ncclSocketTaskChunk {
+  struct ncclSocketTaskChunk* next;
+  struct ncclSocketTask tasks[TASK_CHUNK];
+};
 
-struct ncclSocketThreadResources {
-  struct ncclSocketTaskQueue threadTaskQueue;
-  enum threadState state;
+/* Data socket served by the helper thread pool. Tasks on a socket share one
+ * TCP stream, so they are progressed in order and by a single thread at a
+ * time : the thread which dequeued the socket owns it until it either parks
+ * it in the kernel (epoll or io_uring) or releases it.
+ */
+struct ncclSocketSock {
+  int fd;
+  int home; // Pool thread the socket is queued on when new tasks are posted
   struct ncclSocketComm* comm;
-  pthread_mutex_t threadLock;
-  pthread_cond_t  threadCond;
+  // Number of tasks posted times two, plus one while the socket is queued or owned by a pool thread
+  volatile uint64_t sched;
+  uint64_t head; // Next task to progress
+  volatile uint64_t done; // All tasks before done are complete, their slots can be reused
+  int inflight;  // An io_uring operation is posted for the head task
+  int error;
+  volatile int abort;
+  struct ncclSocketZcSock* zc;
+  struct ncclSocketSock* next; // Run queue
+  struct ncclSocketTask* tasks[MAX_QUEUE_LEN];
 };
 
 struct ncclSocketListenComm {
   int fd;
+  int bondFds[MAX_BOND_IFS-1];
+  int nBondFds;
   int nSocks;
-  int nThreads;
+  int dev;
+  int codecs;
 };
 
 struct ncclSocketComm {
   int ctrlFd;
   int fds[MAX_SOCKETS];
   int nSocks;
-  int nThreads;
+  int dev;
   int nextFd;
-  struct ncclSocketRequest requests[MAX_REQUESTS];
-  pthread_t helperThread[MAX_THREADS];
-  struct ncclSocketThreadResources threadResources[MAX_THREADS];
+  struct ncclSocketRequest* freeReqs;
+  struct ncclSocketRequestChunk* reqChunks;
+  int nRequests;
+  struct ncclSocketTask* freeTasks;
+  struct ncclSocketTaskChunk* taskChunks;
+  // Requests waiting for room on their data sockets, in the order they started
+  struct ncclSocketRequest* postHead;
+  struct ncclSocketRequest* postTail;
+  uint64_t postWaits;
+  uint64_t reqWaits;
+  // Send requests whose header was not sent yet, in the order they were posted
+  struct ncclSocketRequest* ctrlQueue[MAX_REQUESTS];
+  uint64_t ctrlHead;
+  uint64_t ctrlTail;
+  struct ncclSocketRequest* ctrlBusy; // Inline payload in progress on ctrlFd
+  // Data received on ctrlFd which was not consumed yet
+  char ctrlBuf[CTRL_BUF_SIZE];
+  int ctrlBufHead;
+  int ctrlBufTail;
+  struct ncclSocketSock* socks; // Allocated when the first task is posted
+  struct ncclSocketZcSock* zc; // One per data socket, NULL when zero-copy is disabled
+  // Updated by the pool threads and the calling thread, always atomically
+  uint64_t zcBytes;
+  uint64_t copiedBytes;
+  float bw[MAX_SOCKETS]; // Send throughput of each data socket in bytes/us, 0 until measured
+  uint64_t steals;
+  int codec; // Codec used for sends
+  int codecs; // Mask of the codecs accepted on receives
+  char* codecBufs; // MAX_FRAME_SIZE per data socket
+  uint64_t encodedBytes; // Payload sent encoded, before and after encoding
+  uint64_t encodedWireBytes;
 };
 
-void* persistentSocketThread(void *args_) {
-  struct ncclSocketThreadResources* resource = (struct ncclSocketThreadResources*)args_;
-  struct ncclSocketComm* comm = resource->comm;
-  volatile enum threadState* state = &resource->state;
-  struct ncclSocketTaskQueue* myQueue = &resource->threadTaskQueue;
-  int nSocksPerThread = comm->nSocks / comm->nThreads;
+static void ncclSocketTaskDone(struct ncclSocketTask* r) {
+  __sync_fetch_and_add(&r->req->nCompleted, 1);
+}
+
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+static ncclResult_t ncclSocketZcSend(struct ncclSocketTask* r) {
+  struct ncclSocketZcSock* zc = r->zc;
+  struct ncclSocketComm* comm = r->req->comm;
+  char* data = (char*)r->data;
+  int flags = MSG_ZEROCOPY;
+  while (r->offset < r->size) {
+    // Too many sends waiting for completion, copy instead
+    if (zc->nextSeq - zc->doneSeq >= ZC_MAX_PENDING) flags = 0;
+    int bytes = send(r->fd, data+r->offset, r->size-r->offset, MSG_DONTWAIT | flags);
+    if (bytes == -1) {
+      if (errno == ENOBUFS && flags) { flags = 0; continue; } // Over the optmem limit
+      if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) break;
+      WARN("Call to send failed : %s", strerror(errno));
+      return ncclSystemError;
+    }
+    if (flags) {
+      zc->bytes[zc->nextSeq%ZC_MAX_PENDING] = bytes;
+      zc->nextSeq++;
+      r->zcEnd = zc->nextSeq;
+    } else {
+      __sync_fetch_and_add(&comm->copiedBytes, bytes);
+    }
+    r->offset += bytes;
+  }
+  return ncclSuccess;
+}
+
+// Read zero-copy completions from the socket error queue
+static ncclResult_t ncclSocketZcPoll(struct ncclSocketZcSock* zc, struct ncclSocketComm* comm) {
+  while (1) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(zc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+      if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) return ncclSuccess;
+      WARN("Call to recvmsg failed : %s", strerror(errno));
+      return ncclSystemError;
+    }
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+            (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+      struct sock_extended_err* serr = (struct sock_extended_err*)CMSG_DATA(cm);
+      if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+      if (serr->ee_errno != 0) {
+        WARN("NET/Socket : zero-copy send failed : %s", strerror(serr->ee_errno));
+        return ncclSystemError;
+      }
+      // The kernel may have copied the data anyway, e.g. on loopback
+      uint64_t* counter = (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) ? &comm->copiedBytes : &comm->zcBytes;
+      for (uint32_t seq = serr->ee_info; ; seq++) {
+        zc->done[seq%ZC_MAX_PENDING] = 1;
+        __sync_fetch_and_add(counter, zc->bytes[seq%ZC_MAX_PENDING]);
+        if (seq == serr->ee_data) break;
+      }
+    }
+    while (zc->doneSeq != zc->nextSeq && zc->done[zc->doneSeq%ZC_MAX_PENDING]) {
+      zc->done[zc->doneSeq%ZC_MAX_PENDING] = 0;
+      zc->doneSeq++;
+    }
+  }
+}
+
+static ncclResult_t ncclSocketZcEnable(struct ncclSocketComm* comm) {
+  if (ncclParamSocketZeroCopyThreshold() <= 0 || comm->nSocks == 0) return ncclSuccess;
+  for (int i=0; i<comm->nSocks; i++) {
+    const int one = 1;
+    if (setsockopt(comm->fds[i], SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+      INFO(NCCL_NET, "NET/Socket : unable to enable zero-copy sends : %s", strerror(errno));
+      return ncclSuccess;
+    }
+  }
+  NCCLCHECK(ncclCalloc(&comm->zc, comm->nSocks));
+  for (int i=0; i<comm->nSocks; i++) comm->zc[i].fd = comm->fds[i];
+  return ncclSuccess;
+}
+#else
+static ncclResult_t ncclSocketZcSend(struct ncclSocketTask* r) { return ncclInternalError; }
+static ncclResult_t ncclSocketZcPoll(struct ncclSocketZcSock* zc, struct ncclSocketComm* comm) { return ncclInternalError; }
+static ncclResult_t ncclSocketZcEnable(struct ncclSocketComm* comm) {
+  if (ncclParamSocketZeroCopyThreshold() > 0) INFO(NCCL_NET, "NET/Socket : built without zero-copy support");
+  return ncclSuccess;
+}
+#endif
+
+static uint64_t ncclSocketTimeUs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+// Give each socket a share of the payload proportional to its throughput
+static void ncclSocketSplit(struct ncclSocketRequest* r) {
+  struct ncclSocketComm* comm = r->comm;
+  double w[MAX_SOCKETS], total = 0, maxBw = 0;
+  for (int i=0; i<r->nSubs; i++) maxBw = std::max(maxBw, (double)comm->bw[(r->sock+i)%comm->nSocks]);
+  for (int i=0; i<r->nSubs; i++) {
+    // Slow sockets keep a small share, so that we notice when they speed up again
+    w[i] = maxBw == 0 ? 1 : std::max((double)comm->bw[(r->sock+i)%comm->nSocks], maxBw/8);
+    total += w[i];
+  }
+  uint32_t start = 0;
+  for (int i=0; i<r->nSubs; i++) {
+    uint32_t end = i == r->nSubs-1 ? r->size : start + (uint32_t)(r->size*w[i]/total);
+    end = std::min(std::max(end, start), (uint32_t)r->size);
+    r->ranges[i] = ((uint64_t)start << 32) | end;
+    start = end;
+  }
+}
+
+// Claim the next frame to send : from the range of this task first, then
+// from the end of the range with the most data left, so that sockets which
+// are done help the ones lagging behind. Tasks which did not start yet are
+// left alone ; their socket may just be waiting for its turn on a thread.
+static void ncclSocketClaimFrame(struct ncclSocketTask* r) {
+  struct ncclSocketRequest* req = r->req;
+  volatile uint64_t* range = req->ranges+r->sub;
+  uint64_t val;
+  while (1) {
+    val = *range;
+    uint32_t start = val >> 32, end = (uint32_t)val;
+    if (start == end) break;
+    uint32_t size = std::min(end-start, (uint32_t)MAX_FRAME_SIZE);
+    if (__sync_bool_compare_and_swap(range, val, ((uint64_t)(start+size) << 32) | end)) {
+      r->frame.offset = start;
+      r->frame.size = size;
+      return;
+    }
+  }
+  while (1) {
+    int victim = -1;
+    uint32_t left = 0;
+    for (int i=0; i<req->nSubs; i++) {
+      uint64_t v = req->ranges[i];
+      if ((req->started & (1ULL << i)) == 0) continue;
+      if ((uint32_t)v - (uint32_t)(v >> 32) > left) {
+        val = v;
+        left = (uint32_t)v - (uint32_t)(v >> 32);
+        victim = i;
+      }
+    }
+    if (left < MIN_CHUNKSIZE) break; // Not worth it
+    uint32_t size = std::min(left/2, (uint32_t)MAX_FRAME_SIZE);
+    if (__sync_bool_compare_and_swap(req->ranges+victim, val, val-size)) {
+      r->frame.offset = (uint32_t)val-size;
+      r->frame.size = size;
+      __sync_fetch_and_add(&req->comm->steals, 1);
+      return;
+    }
+  }
+  r->frame.offset = r->frame.size = 0;
+}
+
+// Let the kernel poll the NIC for incoming data when receiving, instead of
+// waiting for an interrupt
+static ncclResult_t ncclSocketSetBusyPoll(struct ncclSocketComm* comm) {
+#ifdef SO_BUSY_POLL
+  int busyPoll = ncclParamSocketBusyPoll();
+  if (busyPoll <= 0) return ncclSuccess;
+  for (int i=0; i<comm->nSocks+1; i++) {
+    int fd = i == comm->nSocks ? comm->ctrlFd : comm->fds[i];
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof(int)) != 0) {
+      INFO(NCCL_NET, "NET/Socket : unable to set SO_BUSY_POLL : %s", strerror(errno));
+      break;
+    }
+  }
+#endif
+  return ncclSuccess;
+}
+
+// Keep little unsent data in the kernel, so that a slow socket stops
+// claiming frames and the other sockets take them instead
+static ncclResult_t ncclSocketSetLowat(struct ncclSocketComm* comm) {
+#ifdef TCP_NOTSENT_LOWAT
+  const int lowat = MIN_CHUNKSIZE;
+  for (int i=0; i<comm->nSocks; i++) {
+    if (setsockopt(comm->fds[i], IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(int)) != 0) {
+      INFO(NCCL_NET, "NET/Socket : unable to set TCP_NOTSENT_LOWAT : %s", strerror(errno));
+      break;
+    }
+  }
+#endif
+  return ncclSuccess;
+}
+
+static void ncclSocketUpdateBw(struct ncclSocketTask* r) {
+  if (r->bytes < MIN_CHUNKSIZE) return; // Too small to tell
+  uint64_t time = std::max(ncclSocketTimeUs()-r->startTime, (uint64_t)1);
+  float bw = (float)r->bytes/time;
+  float* avg = r->req->comm->bw+r->sockIdx;
+  *avg = *avg == 0 ? bw : 0.75f * *avg + 0.25f * bw;
+}
+
+// Codec selected with NCCL_SOCKET_CODEC, NCCL_CODEC_NONE by default
+static int ncclSocketGetCodec() {
+  static int codec = -1;
+  if (codec == -1) {
+    const char* env = getenv("NCCL_SOCKET_CODEC");
+    int c = env ? ncclCodecByName(env) : NCCL_CODEC_NONE;
+    if (c == -1) {
+      WARN("NET/Socket : unknown codec NCCL_SOCKET_CODEC=%s, ignoring", env);
+      c = NCCL_CODEC_NONE;
+    } else if (c != NCCL_CODEC_NONE) {
+      INFO(NCCL_INIT|NCCL_NET, "NET/Socket : NCCL_SOCKET_CODEC set to %s", ncclCodecs[c].name);
+    }
+    codec = c;
+  }
+  return codec;
+}
+
+// Encode the frame to send if that makes it at least 1/8 smaller
+static void ncclSocketEncodeFrame(struct ncclSocketTask* r) {
+  struct ncclSocketComm* comm = r->req->comm;
+  struct ncclSocketFrame* frame = &r->frame;
+  frame->wireSize = frame->size;
+  frame->codec = NCCL_CODEC_NONE;
+  if (comm->codec == NCCL_CODEC_NONE || frame->size < MIN_CHUNKSIZE) return;
+  char* buf = comm->codecBufs+(size_t)r->sockIdx*MAX_FRAME_SIZE;
+  int size = ncclCodecs[comm->codec].encode((char*)r->req->data+frame->offset, frame->size, buf, frame->size-frame->size/8);
+  if (size == 0) return;
+  __sync_fetch_and_add(&comm->encodedBytes, frame->size);
+  __sync_fetch_and_add(&comm->encodedWireBytes, size);
+  frame->wireSize = size;
+  frame->codec = comm->codec;
+}
+
+static ncclResult_t ncclSocketAllocCodecBufs(struct ncclSocketComm* comm) {
+  if (comm->nSocks == 0 || (comm->codec == NCCL_CODEC_NONE && comm->codecs == 0)) return ncclSuccess;
+  NCCLCHECK(ncclCalloc(&comm->codecBufs, (size_t)comm->nSocks*MAX_FRAME_SIZE));
+  return ncclSuccess;
+}
+
+// Move to the next segment of a task once the current one is complete
+static ncclResult_t ncclSocketTaskNext(struct ncclSocketTask* r) {
+  struct ncclSocketRequest* req = r->req;
+  struct ncclSocketFrame* frame = &r->frame;
+  if (r->state == taskStart) {
+    r->startTime = ncclSocketTimeUs();
+    if (r->zc) r->zcEnd = r->zc->nextSeq;
+    if (r->op == NCCL_SOCKET_SEND) __sync_fetch_and_or(&req->started, 1ULL << r->sub);
+  }
+  if (r->state == taskHeader) {
+    if (frame->size == 0) {
+      r->state = taskDone;
+      if (r->op == NCCL_SOCKET_SEND) ncclSocketUpdateBw(r);
+      return ncclSuccess;
+    }
+    if (frame->offset < 0 || frame->size < 0 || frame->offset > req->size-frame->size) {
+      WARN("NET/Socket : invalid frame of %d bytes at offset %d for a message of %d bytes", frame->size, frame->offset, req->size);
+      return ncclInternalError;
+    }
+    if (r->op == NCCL_SOCKET_RECV && (frame->codec == NCCL_CODEC_NONE ? frame->wireSize != frame->size :
+        (frame->codec < 0 || frame->codec >= NCCL_NUM_CODECS || (req->comm->codecs & (1 << frame->codec)) == 0 ||
+         frame->wireSize <= 0 || frame->wireSize > std::min(frame->size, MAX_FRAME_SIZE)))) {
+      WARN("NET/Socket : invalid frame encoding %d of %d bytes for %d bytes of payload", frame->codec, frame->wireSize, frame->size);
+      return ncclInternalError;
+    }
+    r->state = taskPayload;
+    r->data = (char*)req->data+frame->offset;
+    r->size = frame->wireSize;
+    if (frame->codec != NCCL_CODEC_NONE) r->data = req->comm->codecBufs+(size_t)r->sockIdx*MAX_FRAME_SIZE;
+  } else {
+    if (r->state == taskPayload && r->op == NCCL_SOCKET_RECV && frame->codec != NCCL_CODEC_NONE) {
+      NCCLCHECK(ncclCodecs[frame->codec].decode((char*)r->data, frame->wireSize, (char*)req->data+frame->offset, frame->size));
+    }
+    if (r->op == NCCL_SOCKET_SEND) {
+      ncclSocketClaimFrame(r);
+      r->bytes += frame->size;
+      ncclSocketEncodeFrame(r);
+    }
+    r->state = taskHeader;
+    r->data = &r->frame;
+    r->size = sizeof(struct ncclSocketFrame);
+  }
+  r->offset = 0;
+  return ncclSuccess;
+}
+
+/* Helper thread pool.
+ *
+ * A single pool of threads per process serves the data sockets of all comms.
+ * A socket with new tasks is queued on its home thread, and threads with an
+ * empty run queue steal sockets from the other threads. Sockets which cannot
+ * make progress are parked in the pool epoll set until the kernel reports
+ * them ready, so idle threads sleep in epoll_wait. With NCCL_SOCKET_URING=1,
+ * each thread posts operations to its own io_uring instead.
+ *
+ * With NCCL_SOCKET_SPIN_US, idle threads keep polling the run queues and
+ * the kernel for that long before they go to sleep, so that work arriving
+ * shortly after does not pay for a wake-up.
+ */
+#define POOL_MAX_EVENTS 64
+
+struct ncclSocketUringResources;
+
+struct ncclSocketPoolThread {
+  pthread_t thread;
+  int id;
+  pthread_mutex_t lock;
+  struct ncclSocketSock* volatile queueHead;
+  struct ncclSocketSock* queueTail;
+  volatile int sleeping;
+  int nInflight;
+  struct ncclSocketUringResources* uring; // NULL when the pool uses epoll
+  // Statistics, reported when the pool is destroyed
+  uint64_t sleeps;
+  uint64_t spinHits; // Work found while spinning
+  uint64_t spinTime;
+  uint64_t idleTime; // Time spent sleeping
+};
+
+struct ncclSocketPool {
+  int refs;
+  int nThreads;
+  int nextHome;
+  volatile int stop;
+  // Set when a thread fails. Threads then stop serving sockets, and requests
+  // of the sockets they owned fail instead of waiting forever.
+  volatile int failed;
+  volatile int nRunning;
+  int uring;
+  int epollFd;
+  int wakeFd;
+  volatile int nSleeping;
+  int spinUs;
+  uint64_t startTime;
+  volatile uint64_t wakes; // Wake-ups sent to sleeping threads
+  cpu_set_t cpuset;
+  struct ncclSocketPoolThread threads[MAX_THREADS];
+};
+
+static struct ncclSocketPool ncclSocketPool;
+
+static int ncclSocketPoolRunning(struct ncclSocketPool* pool) {
+  return pool->stop == 0 && pool->failed == 0;
+}
+
+static void ncclSocketPoolPush(struct ncclSocketPoolThread* t, struct ncclSocketSock* sock) {
+  sock->next = NULL;
+  pthread_mutex_lock(&t->lock);
+  if (t->queueTail) t->queueTail->next = sock;
+  else t->queueHead = sock;
+  t->queueTail = sock;
+  pthread_mutex_unlock(&t->lock);
+}
+
+static struct ncclSocketSock* ncclSocketPoolPop(struct ncclSocketPoolThread* t) {
+  if (t->queueHead == NULL) return NULL;
+  pthread_mutex_lock(&t->lock);
+  struct ncclSocketSock* sock = t->queueHead;
+  if (sock) {
+    t->queueHead = sock->next;
+    if (t->queueHead == NULL) t->queueTail = NULL;
+  }
+  pthread_mutex_unlock(&t->lock);
+  return sock;
+}
+
+// Take a socket from our own run queue, or steal one from another thread
+static struct ncclSocketSock* ncclSocketPoolGetWork(struct ncclSocketPool* pool, int tid) {
+  struct ncclSocketSock* sock = NULL;
+  for (int i=0; i<pool->nThreads && sock == NULL; i++) {
+    sock = ncclSocketPoolPop(pool->threads+(tid+i)%pool->nThreads);
+  }
+  return sock;
+}
+
+static int ncclSocketPoolEmpty(struct ncclSocketPool* pool) {
+  for (int i=0; i<pool->nThreads; i++) {
+    if (pool->threads[i].queueHead) return 0;
+  }
+  return 1;
+}
+
+static ncclResult_t ncclSocketPoolArm(struct ncclSocketPool* pool, int fd, int events, void* ptr) {
+  struct epoll_event ev;
+  ev.events = events | EPOLLONESHOT;
+  ev.data.ptr = ptr;
+  if (epoll_ctl(pool->epollFd, EPOLL_CTL_MOD, fd, &ev) == 0) return ncclSuccess;
+  if (errno == ENOENT && epoll_ctl(pool->epollFd, EPOLL_CTL_ADD, fd, &ev) == 0) return ncclSuccess;
+  WARN("Call to epoll_ctl failed : %s", strerror(errno));
+  return ncclSystemError;
+}
+
+static ncclResult_t ncclSocketPoolWakeFd(int fd) {
+  uint64_t one = 1;
+  SYSCHECK(write(fd, &one, sizeof(uint64_t)), "write");
+  return ncclSuccess;
+}
+
+// Progress the tasks of a socket until it would block. Returns the epoll
+// events to wait for, or 0 when all tasks are complete.
+static ncclResult_t ncclSocketSockProgress(struct ncclSocketSock* sock, int* events) {
+  struct ncclSocketComm* comm = sock->comm;
+  uint64_t posted = sock->sched >> 1;
+  __sync_synchronize();
+  *events = 0;
+  while (sock->head < posted) {
+    struct ncclSocketTask* r = sock->tasks[sock->head%MAX_QUEUE_LEN];
+    if (r->offset == r->size) {
+      NCCLCHECK(ncclSocketTaskNext(r));
+      if (r->state == taskDone) {
+        sock->head++;
+        continue;
+      }
+    }
+    // Encoded payloads are staged in a buffer we reuse for the next frame
+    if (r->zc && r->state == taskPayload && r->frame.codec == NCCL_CODEC_NONE) {
+      NCCLCHECK(ncclSocketZcSend(r));
+    } else {
+      int offset = r->offset;
+      NCCLCHECK(socketProgress(r->op, r->fd, r->data, r->size, &r->offset));
+      if (r->op == NCCL_SOCKET_SEND) __sync_fetch_and_add(&comm->copiedBytes, r->offset-offset);
+    }
+    if (r->offset < r->size) {
+      *events = r->op == NCCL_SOCKET_RECV ? EPOLLIN : EPOLLOUT;
+      break;
+    }
+  }
+  // All data of zero-copy sends was handed to the kernel, wait until it
+  // releases the buffers
+  if (sock->zc && sock->done < sock->head) NCCLCHECK(ncclSocketZcPoll(sock->zc, comm));
+  // The request may recycle a task as soon as it is reported done, so this
+  // is the last time we access it
+  for (; sock->done < sock->head; sock->done++) {
+    struct ncclSocketTask* r = sock->tasks[sock->done%MAX_QUEUE_LEN];
+    if (r->zc) {
+      if ((int32_t)(sock->zc->doneSeq - r->zcEnd) < 0) break;
+      r->zc = NULL;
+    }
+    ncclSocketTaskDone(r);
+  }
+  // Completions are reported on the error queue
+  if (sock->done < sock->head) *events |= EPOLLERR;
+  return ncclSuccess;
+}
+
+// Report an error on all tasks which are not complete
+static void ncclSocketSockFail(struct ncclSocketSock* sock) {
+  uint64_t posted = sock->sched >> 1;
+  for (; sock->done < posted; sock->done++) {
+    struct ncclSocketTask* r = sock->tasks[sock->done%MAX_QUEUE_LEN];
+    if (sock->done < sock->head && r->zc == NULL) ncclSocketTaskDone(r);
+    else r->result = ncclSystemError;
+  }
+  sock->head = posted;
+}
+
+#ifdef NCCL_URING_SUPPORTED
+/* io_uring pool threads : the head task of each socket is posted as a
+ * send/recv SQE on the ring of the thread owning the socket, and the socket
+ * stays with that thread until no operation is in flight.
+ */
+#define URING_WAKE_TAG 0
+
+struct ncclSocketUringResources {
+  struct ncclUring ring;
+  int wakeFd;
+  uint64_t wakeVal;
+};
+
+static ncclResult_t ncclSocketUringPost(struct ncclSocketPoolThread* t, struct ncclSocketSock* sock) {
+  uint64_t posted = sock->sched >> 1;
+  __sync_synchronize();
+  struct ncclSocketTask* r;
   while (1) {
-    int idle = 1;
-    int mark = myQueue->next; // mark newest task seen
-    for (int i=0; i<MAX_QUEUE_LEN; i+=nSocksPerThread) {
-      int repeat;
-      do {
-        repeat = 0;
-        for (int j=0; j<nSocksPerThread; j++) {
-          struct ncclSocketTask* r = myQueue->tasks+i+j;
-          if (r != NULL && r->used == 1 && r->offset < r->size) {
-            r->result = socketProgress(r->op, r->fd, r->data, r->size, &r->offset);
-            if (r->result != ncclSuccess) {
-              WARN("NET/Socket : socket progress error");
-              return NULL;
-            }
-            idle = 0;
-            if (r->offset < r->size) repeat = 1;
-          }
+    if (sock->inflight || sock->head == posted) return ncclSuccess;
+    r = sock->tasks[sock->head%MAX_QUEUE_LEN];
+    if (r->offset < r->size) break;
+    NCCLCHECK(ncclSocketTaskNext(r));
+    if (r->state == taskDone) {
+      ncclSocketTaskDone(r);
+      sock->done = ++sock->head;
+    }
+  }
+  int opcode = r->op == NCCL_SOCKET_RECV ? IORING_OP_RECV : IORING_OP_SEND;
+  int flags = r->op == NCCL_SOCKET_RECV ? MSG_WAITALL : MSG_NOSIGNAL;
+  NCCLCHECK(ncclUringPrep(&t->uring->ring, opcode, r->fd, (char*)r->data+r->offset, r->size-r->offset, flags, (uint64_t)sock));
+  sock->inflight = 1;
+  t->nInflight++;
+  return ncclSuccess;
+}
+
+static void ncclSocketUringComplete(struct ncclSocketSock* sock, int ret) {
+  struct ncclSocketTask* r = sock->tasks[sock->head%MAX_QUEUE_LEN];
+  sock->inflight = 0;
+  if (sock->abort) {
+    sock->error = 1;
+    return;
+  }
+  if (ret < 0 && ret != -EAGAIN && ret != -EINTR) {
+    WARN("NET/Socket : io_uring %s failed : %s", r->op == NCCL_SOCKET_RECV ? "recv" : "send", strerror(-ret));
+    sock->error = 1;
+    return;
+  }
+  if (ret == 0 && r->op == NCCL_SOCKET_RECV) {
+    WARN("Net : Connection closed by remote peer");
+    sock->error = 1;
+    return;
+  }
+  if (ret > 0) r->offset += ret;
+  if (ret > 0 && r->op == NCCL_SOCKET_SEND) __sync_fetch_and_add(&sock->comm->copiedBytes, ret);
+}
+
+static ncclResult_t ncclSocketUringCreate(struct ncclSocketUringResources** uringPtr) {
+  *uringPtr = NULL;
+  struct ncclSocketUringResources* uring;
+  NCCLCHECK(ncclCalloc(&uring, 1));
+  const int ops[] = { IORING_OP_SEND, IORING_OP_RECV, IORING_OP_READ };
+  // One SQE per socket in flight plus the wake-up read
+  if (ncclUringInit(&uring->ring, 2*MAX_QUEUE_LEN, ops, sizeof(ops)/sizeof(int)) != ncclSuccess) {
+    free(uring);
+    return ncclSuccess;
+  }
+  uring->wakeFd = eventfd(0, EFD_CLOEXEC);
+  if (uring->wakeFd == -1) {
+    WARN("NET/Socket : eventfd creation failed : %s", strerror(errno));
+    ncclUringClose(&uring->ring);
+    free(uring);
+    return ncclSystemError;
+  }
+  if (ncclUringPrep(&uring->ring, IORING_OP_READ, uring->wakeFd, &uring->wakeVal, sizeof(uint64_t), 0, URING_WAKE_TAG) != ncclSuccess) {
+    close(uring->wakeFd);
+    ncclUringClose(&uring->ring);
+    free(uring);
+    return ncclInternalError;
+  }
+  *uringPtr = uring;
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclSocketUringWake(struct ncclSocketUringResources* uring) {
+  return ncclSocketPoolWakeFd(uring->wakeFd);
+}
+
+static ncclResult_t ncclSocketUringDestroy(struct ncclSocketUringResources* uring) {
+  NCCLCHECK(ncclUringClose(&uring->ring));
+  close(uring->wakeFd);
+  free(uring);
+  return ncclSuccess;
+}
+#else
+static ncclResult_t ncclSocketUringPost(struct ncclSocketPoolThread* t, struct ncclSocketSock* sock) { return ncclInternalError; }
+static void ncclSocketUringComplete(struct ncclSocketSock* sock, int ret) { }
+static ncclResult_t ncclSocketUringCreate(struct ncclSocketUringResources** uringPtr) {
+  *uringPtr = NULL;
+  return ncclSuccess;
+}
+static ncclResult_t ncclSocketUringWake(struct ncclSocketUringResources* uring) { return ncclSuccess; }
+static ncclResult_t ncclSocketUringDestroy(struct ncclSocketUringResources* uring) { return ncclSuccess; }
+#endif
+
+static ncclResult_t ncclSocketPoolWake(struct ncclSocketPool* pool, int tid) {
+  if (pool->uring) {
+    if (pool->threads[tid].sleeping == 0) return ncclSuccess;
+    NCCLCHECK(ncclSocketUringWake(pool->threads[tid].uring));
+  } else {
+    if (pool->nSleeping == 0) return ncclSuccess;
+    NCCLCHECK(ncclSocketPoolWakeFd(pool->wakeFd));
+  }
+  __sync_fetch_and_add(&pool->wakes, 1);
+  return ncclSuccess;
+}
+
+// Post a new task on a socket, and queue the socket unless a thread already has it
+static ncclResult_t ncclSocketSockPost(struct ncclSocketPool* pool, struct ncclSocketSock* sock) {
+  if (pool->failed) {
+    WARN("NET/Socket : helper threads failed");
+    return ncclSystemError;
+  }
+  uint64_t sched;
+  do {
+    sched = sock->sched;
+  } while (!__sync_bool_compare_and_swap(&sock->sched, sched, (sched+2)|1));
+  if (sched & 1) return ncclSuccess;
+  ncclSocketPoolPush(pool->threads+sock->home, sock);
+  __sync_synchronize();
+  return ncclSocketPoolWake(pool, sock->home);
+}
+
+// Progress a socket owned by the calling thread, until it is either parked
+// in the kernel or released. The socket must not be accessed afterwards.
+static void ncclSocketSockRun(struct ncclSocketPool* pool, struct ncclSocketPoolThread* t, struct ncclSocketSock* sock) {
+  while (1) {
+    if (sock->abort) sock->error = 1;
+    if (sock->error == 0) {
+      if (t->uring) {
+        if (ncclSocketUringPost(t, sock) != ncclSuccess) sock->error = 1;
+        else if (sock->inflight) return;
+      } else {
+        int events;
+        if (ncclSocketSockProgress(sock, &events) != ncclSuccess) {
+          WARN("NET/Socket : socket progress error");
+          sock->error = 1;
+        } else if (events) {
+          if (ncclSocketPoolArm(pool, sock->fd, events, sock) == ncclSuccess) return;
+          sock->error = 1;
         }
-      } while (repeat);
+      }
     }
-    if (idle) {
-      pthread_mutex_lock(&resource->threadLock);
-      while (mark == myQueue->next && *state != stop) { // no new tasks, wait
-        pthread_cond_wait(&resource->threadCond, &resource->threadLock);
+    if (sock->error) ncclSocketSockFail(sock);
+    // Release the socket, unless new tasks were posted in the meantime
+    uint64_t owned = (sock->head << 1) | 1;
+    if (__sync_bool_compare_and_swap(&sock->sched, owned, owned-1)) return;
+  }
+}
+
+// Wait for sockets to become ready, or only check for them if block is 0.
+// nWork is set to the number of sockets which became ready.
+static ncclResult_t ncclSocketPoolWaitEpoll(struct ncclSocketPool* pool, struct ncclSocketPoolThread* t, int block, int* nWork) {
+  struct epoll_event events[POOL_MAX_EVENTS];
+  int nEvents = 0;
+  *nWork = 0;
+  if (block) {
+    __sync_fetch_and_add(&pool->nSleeping, 1);
+    // Sockets queued before we were counted as sleeping did not trigger a wake-up
+    if (ncclSocketPoolEmpty(pool) && ncclSocketPoolRunning(pool)) {
+      uint64_t start = ncclSocketTimeUs();
+      nEvents = epoll_wait(pool->epollFd, events, POOL_MAX_EVENTS, -1);
+      t->idleTime += ncclSocketTimeUs()-start;
+      t->sleeps++;
+    }
+    __sync_fetch_and_sub(&pool->nSleeping, 1);
+  } else {
+    nEvents = epoll_wait(pool->epollFd, events, POOL_MAX_EVENTS, 0);
+  }
+  if (nEvents == -1) {
+    if (errno == EINTR) return ncclSuccess;
+    WARN("Call to epoll_wait failed : %s", strerror(errno));
+    return ncclSystemError;
+  }
+  int nQueued = 0;
+  for (int e=0; e<nEvents; e++) {
+    struct ncclSocketSock* sock = (struct ncclSocketSock*)events[e].data.ptr;
+    if (sock == NULL) {
+      // Leave the counter set when stopping so that the next thread wakes up too
+      uint64_t val;
+      if (ncclSocketPoolRunning(pool) && read(pool->wakeFd, &val, sizeof(uint64_t)) == -1 && errno != EAGAIN) {
+        WARN("Call to read failed : %s", strerror(errno));
+        return ncclSystemError;
       }
-      pthread_mutex_unlock(&resource->threadLock);
+      NCCLCHECK(ncclSocketPoolArm(pool, pool->wakeFd, EPOLLIN, NULL));
+      continue;
     }
-    if (*state == stop) return NULL;
+    ncclSocketPoolPush(t, sock);
+    nQueued++;
   }
+  // Let another thread steal some of the sockets
+  if (nQueued > 1) NCCLCHECK(ncclSocketPoolWake(pool, t->id));
+  *nWork = nQueued;
+  return ncclSuccess;
 }
 
-ncclResult_t ncclSocketGetNsockNthread(int dev, int* ns, int* nt) {
-  int nSocksPerThread = ncclParamSocketNsocksPerThread();
+#ifdef NCCL_URING_SUPPORTED
+static ncclResult_t ncclSocketPoolWaitUring(struct ncclSocketPool* pool, struct ncclSocketPoolThread* t, int block, int* nWork) {
+  struct ncclSocketUringResources* uring = t->uring;
+  *nWork = 0;
+  if (block) {
+    t->sleeping = 1;
+    __sync_synchronize();
+  }
+  int waitNr = block && (t->nInflight >= MAX_QUEUE_LEN || ncclSocketPoolEmpty(pool)) && ncclSocketPoolRunning(pool) ? 1 : 0;
+  uint64_t start = waitNr ? ncclSocketTimeUs() : 0;
+  ncclResult_t ret = ncclUringSubmitAndWait(&uring->ring, waitNr);
+  t->sleeping = 0;
+  if (waitNr) {
+    t->idleTime += ncclSocketTimeUs()-start;
+    t->sleeps++;
+  }
+  NCCLCHECK(ret);
+  struct io_uring_cqe* cqe;
+  while ((cqe = ncclUringPeekCqe(&uring->ring)) != NULL) {
+    uint64_t tag = cqe->user_data;
+    int bytes = cqe->res;
+    ncclUringCqeSeen(&uring->ring);
+    if (tag == URING_WAKE_TAG) {
+      NCCLCHECK(ncclUringPrep(&uring->ring, IORING_OP_READ, uring->wakeFd, &uring->wakeVal, sizeof(uint64_t), 0, URING_WAKE_TAG));
+      continue;
+    }
+    struct ncclSocketSock* sock = (struct ncclSocketSock*)tag;
+    t->nInflight--;
+    (*nWork)++;
+    ncclSocketUringComplete(sock, bytes);
+    ncclSocketSockRun(pool, t, sock);
+  }
+  return ncclSuccess;
+}
+#else
+static ncclResult_t ncclSocketPoolWaitUring(struct ncclSocketPool* pool, struct ncclSocketPoolThread* t, int block, int* nWork) { return ncclInternalError; }
+#endif
+
+static ncclResult_t ncclSocketPoolWakeAll(struct ncclSocketPool* pool) {
+  if (pool->uring) {
+    for (int i=0; i<pool->nThreads; i++) NCCLCHECK(ncclSocketUringWake(pool->threads[i].uring));
+  } else {
+    NCCLCHECK(ncclSocketPoolWakeFd(pool->wakeFd));
+  }
+  return ncclSuccess;
+}
+
+void* persistentSocketThread(void *args_) {
+  struct ncclSocketPoolThread* t = (struct ncclSocketPoolThread*)args_;
+  struct ncclSocketPool* pool = &ncclSocketPool;
+  if (CPU_COUNT(&pool->cpuset)) sched_setaffinity(0, sizeof(cpu_set_t), &pool->cpuset);
+  // Sockets are shut down when a comm is closed with requests in flight ; get EPIPE instead of a signal
+  sigset_t sigpipe;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+  uint64_t spinStart = 0; // Non-zero while spinning
+  while (ncclSocketPoolRunning(pool)) {
+    // Leave queued sockets to other threads when our ring is full
+    struct ncclSocketSock* sock = t->nInflight < MAX_QUEUE_LEN ? ncclSocketPoolGetWork(pool, t->id) : NULL;
+    if (sock) {
+      if (spinStart) {
+        t->spinHits++;
+        t->spinTime += ncclSocketTimeUs()-spinStart;
+        spinStart = 0;
+      }
+      ncclSocketSockRun(pool, t, sock);
+      continue;
+    }
+    int block = 1;
+    if (pool->spinUs) {
+      uint64_t now = ncclSocketTimeUs();
+      if (spinStart == 0) spinStart = now;
+      if (now-spinStart < pool->spinUs) block = 0;
+      else {
+        t->spinTime += now-spinStart;
+        spinStart = 0;
+      }
+    }
+    int nWork;
+    if ((t->uring ? ncclSocketPoolWaitUring(pool, t, block, &nWork) : ncclSocketPoolWaitEpoll(pool, t, block, &nWork)) != ncclSuccess) {
+      WARN("NET/Socket : helper thread %d failed", t->id);
+      pool->failed = 1;
+      ncclSocketPoolWakeAll(pool);
+      break;
+    }
+    if (block == 0 && nWork) {
+      t->spinHits++;
+      t->spinTime += ncclSocketTimeUs()-spinStart;
+      spinStart = 0;
+    } else if (block == 0) {
+      // Do not delay the threads posting work if we share their core
+      sched_yield();
+    }
+  }
+  __sync_fetch_and_sub(&pool->nRunning, 1);
+  return NULL;
+}
+
+// Use the cores local to the NIC, among those we are allowed to run on
+static ncclResult_t ncclSocketPoolGetCpuset(int dev, cpu_set_t* cpuset) {
+  cpu_set_t allowed;
+  CPU_ZERO(cpuset);
+  SYSCHECK(sched_getaffinity(0, sizeof(cpu_set_t), &allowed), "sched_getaffinity");
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "/sys/class/net/%s/device/local_cpus", ncclSocketDevs[dev].devName);
+  FILE* file = fopen(path, "r");
+  if (file != NULL) {
+    char str[4096];
+    if (fgets(str, sizeof(str), file) != NULL) NCCLCHECK(ncclStrToCpuset(str, cpuset));
+    fclose(file);
+  }
+  CPU_AND(cpuset, cpuset, &allowed);
+  if (CPU_COUNT(cpuset) == 0) memcpy(cpuset, &allowed, sizeof(cpu_set_t));
+  return ncclSuccess;
+}
+
+// Stop and join the first nStarted threads, and release the pool resources
+static ncclResult_t ncclSocketPoolRelease(struct ncclSocketPool* pool, int nStarted) {
+  ncclResult_t ret = ncclSuccess;
+  pool->stop = 1;
+  if (nStarted) ret = ncclSocketPoolWakeAll(pool);
+  for (int i=0; i<pool->nThreads; i++) {
+    struct ncclSocketPoolThread* t = pool->threads+i;
+    if (i < nStarted) {
+      pthread_join(t->thread, NULL);
+      pthread_mutex_destroy(&t->lock);
+    }
+    if (t->uring) ncclSocketUringDestroy(t->uring);
+    t->uring = NULL;
+  }
+  if (pool->epollFd != -1) close(pool->epollFd);
+  if (pool->wakeFd != -1) close(pool->wakeFd);
+  pool->epollFd = pool->wakeFd = -1;
+  return ret;
+}
+
+static ncclResult_t ncclSocketPoolCreate(struct ncclSocketPool* pool, int dev) {
+  NCCLCHECK(ncclSocketPoolGetCpuset(dev, &pool->cpuset));
   int nThreads = ncclParamSocketNthreads();
-  if (nThreads > MAX_THREADS) {
+  if (nThreads == -2) nThreads = CPU_COUNT(&pool->cpuset); // One thread per NIC-local core
+  if (nThreads > MAX_THREADS && ncclParamSocketNthreads() != -2) {
     WARN("NET/Socket : NCCL_SOCKET_NTHREADS is greater than the maximum allowed, setting to %d", MAX_THREADS);
-    nThreads = MAX_THREADS;
-  }
-  if (nThreads == -2 || nSocksPerThread == -2) {
-    // Auto-detection
-    int autoNt=0, autoNs=1; // By default, we only use the main thread and do not spawn extra threads
-    char vendorPath[PATH_MAX];
-    snprintf(vendorPath, PATH_MAX, "/sys/class/net/%s/device/vendor", ncclSocketDevs[dev].devName);
-    char* rPath = realpath(vendorPath, NULL);
-    int fd = open(rPath, O_RDONLY);
-    free(rPath);
-    if (fd == -1) {
-      // Could not find device vendor. This is handled silently so
-      // we don't want to print an INFO error.
-      TRACE(NCCL_NET, "Open of %s failed : %s\n", vendorPath, strerror(errno));
-      goto end;
+  }
+  pool->nThreads = std::max(1, std::min(nThreads, MAX_THREADS));
+  pool->nextHome = 0;
+  pool->stop = 0;
+  pool->failed = 0;
+  pool->nRunning = 0;
+  pool->nSleeping = 0;
+  pool->spinUs = std::max((int)ncclParamSocketSpinUs(), 0);
+  pool->startTime = ncclSocketTimeUs();
+  pool->wakes = 0;
+  pool->uring = 0;
+  pool->epollFd = pool->wakeFd = -1;
+  for (int i=0; i<pool->nThreads; i++) pool->threads[i].uring = NULL;
+
+  ncclResult_t ret = ncclSuccess;
+  int nStarted = 0;
+  if (ncclParamSocketUring()) {
+    pool->uring = 1;
+    for (int i=0; i<pool->nThreads; i++) {
+      NCCLCHECKGOTO(ncclSocketUringCreate(&pool->threads[i].uring), ret, fail);
+      if (pool->threads[i].uring == NULL) pool->uring = 0;
     }
+    if (pool->uring == 0) {
+      for (int i=0; i<pool->nThreads; i++) {
+        if (pool->threads[i].uring) ncclSocketUringDestroy(pool->threads[i].uring);
+        pool->threads[i].uring = NULL;
+      }
+      INFO(NCCL_NET, "NET/Socket : io_uring not available, using epoll-based helper threads");
+    }
+  }
+  if (pool->uring == 0) {
+    pool->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool->epollFd != -1) pool->wakeFd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+    if (pool->epollFd == -1 || pool->wakeFd == -1) {
+      WARN("NET/Socket : could not create the helper threads wake-up fds : %s", strerror(errno));
+      ret = ncclSystemError;
+      goto fail;
+    }
+    NCCLCHECKGOTO(ncclSocketPoolArm(pool, pool->wakeFd, EPOLLIN, NULL), ret, fail);
+  }
+
+  for (; nStarted<pool->nThreads; nStarted++) {
+    struct ncclSocketPoolThread* t = pool->threads+nStarted;
+    t->id = nStarted;
+    t->queueHead = t->queueTail = NULL;
+    t->sleeping = 0;
+    t->nInflight = 0;
+    t->sleeps = t->spinHits = t->spinTime = t->idleTime = 0;
+    pthread_mutex_init(&t->lock, NULL);
+    int err = pthread_create(&t->thread, NULL, persistentSocketThread, t);
+    if (err != 0) {
+      WARN("NET/Socket : could not create helper thread %d : %s", nStarted, strerror(err));
+      pthread_mutex_destroy(&t->lock);
+      ret = ncclSystemError;
+      goto fail;
+    }
+    __sync_fetch_and_add(&pool->nRunning, 1);
+  }
+  {
+    char affinityStr[sizeof(cpu_set_t)*3];
+    NCCLCHECK(ncclCpusetToStr(&pool->cpuset, affinityStr));
+    INFO(NCCL_INIT|NCCL_NET, "NET/Socket : Using a pool of %d %s helper threads, affinity %s, spinning %d us before sleeping",
+        pool->nThreads, pool->uring ? "io_uring" : "epoll", affinityStr, pool->spinUs);
+  }
+  return ncclSuccess;
+fail:
+  ncclSocketPoolRelease(pool, nStarted);
+  return ret;
+}
+
+// Report how often helper threads slept and spun, to help tuning NCCL_SOCKET_SPIN_US
+static void ncclSocketPoolStats(struct ncclSocketPool* pool) {
+  uint64_t sleeps = 0, spinHits = 0, spinTime = 0, idleTime = 0;
+  for (int i=0; i<pool->nThreads; i++) {
+    struct ncclSocketPoolThread* t = pool->threads+i;
+    sleeps += t->sleeps;
+    spinHits += t->spinHits;
+    spinTime += t->spinTime;
+    idleTime += t->idleTime;
+  }
+  double total = std::max((double)(ncclSocketTimeUs()-pool->startTime)*pool->nThreads, 1.0);
+  INFO(NCCL_NET, "NET/Socket : helper threads slept %lu times, %lu wake-ups sent, spinning found work %lu times ; idle %.1f%%, spinning %.1f%%",
+      sleeps, pool->wakes, spinHits, idleTime*100/total, spinTime*100/total);
+}
+
+static ncclResult_t ncclSocketPoolDestroy(struct ncclSocketPool* pool) {
+  ncclResult_t ret = ncclSocketPoolRelease(pool, pool->nThreads);
+  ncclSocketPoolStats(pool);
+  return ret;
+}
+
+static ncclResult_t ncclSocketPoolAttach(struct ncclSocketComm* comm) {
+  struct ncclSocketPool* pool = &ncclSocketPool;
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECK(ncclCalloc(&comm->socks, comm->nSocks));
+  pthread_mutex_lock(&ncclSocketLock);
+  if (pool->refs == 0) ret = ncclSocketPoolCreate(pool, comm->dev);
+  if (ret == ncclSuccess) {
+    pool->refs++;
+    for (int i=0; i<comm->nSocks; i++) {
+      struct ncclSocketSock* sock = comm->socks+i;
+      sock->fd = comm->fds[i];
+      sock->comm = comm;
+      sock->zc = comm->zc ? comm->zc+i : NULL;
+      sock->home = pool->nextHome++ % pool->nThreads;
+    }
+  }
+  pthread_mutex_unlock(&ncclSocketLock);
+  if (ret != ncclSuccess) {
+    free(comm->socks);
+    comm->socks = NULL;
+  }
+  return ret;
+}
+
+static ncclResult_t ncclSocketPoolDetach(struct ncclSocketComm* comm) {
+  struct ncclSocketPool* pool = &ncclSocketPool;
+  // Sockets may still be in use if the comm is closed with requests in
+  // flight. Shut them down so that pending operations return.
+  for (int i=0; i<comm->nSocks; i++) {
+    struct ncclSocketSock* sock = comm->socks+i;
+    if (sock->sched & 1) {
+      sock->abort = 1;
+      shutdown(sock->fd, SHUT_RDWR);
+    }
+  }
+  for (int i=0; i<comm->nSocks; i++) {
+    while ((comm->socks[i].sched & 1) && pool->failed == 0) sched_yield();
+  }
+  // Sockets owned by threads of a failed pool are never released. Wait until
+  // no thread can touch them anymore.
+  while (pool->failed && pool->nRunning) sched_yield();
+  free(comm->socks);
+  comm->socks = NULL;
+  pthread_mutex_lock(&ncclSocketLock);
+  ncclResult_t ret = ncclSuccess;
+  if (--pool->refs == 0) ret = ncclSocketPoolDestroy(pool);
+  pthread_mutex_unlock(&ncclSocketLock);
+  return ret;
+}
+
+/* Number of sockets per connection. Helper threads are shared by all
+ * connections and sized by NCCL_SOCKET_NTHREADS in ncclSocketPoolCreate, so
+ * the count only depends on NCCL_NSOCKS_PERTHREAD and on the number of
+ * threads each connection used to get on the vendor's instances.
+ */
+ncclResult_t ncclSocketGetNsocks(int dev, int* ns) {
+  int nSocksPerThread = ncclParamSocketNsocksPerThread();
+  // By default, we only use the main thread and do not open extra sockets
+  int autoNt=0, autoNs=1;
+  char vendorPath[PATH_MAX];
+  snprintf(vendorPath, PATH_MAX, "/sys/class/net/%s/device/vendor", ncclSocketDevs[dev].devName);
+  char* rPath = realpath(vendorPath, NULL);
+  int fd = open(rPath, O_RDONLY);
+  free(rPath);
+  if (fd == -1) {
+    // Could not find device vendor. This is handled silently so
+    // we don't want to print an INFO error.
+    TRACE(NCCL_NET, "Open of %s failed : %s\n", vendorPath, strerror(errno));
+  } else {
     char vendor[7];
     strncpy(vendor, "0x0000", 7);
     int len;
@@ -250,19 +1287,16 @@ ncclResult_t ncclSocketGetNsockNthread(int dev, int* ns, int* nt) {
       autoNt = 4;
       autoNs = 1;
     }
-end:
-    if (nThreads == -2) nThreads = autoNt;
-    if (nSocksPerThread == -2) nSocksPerThread = autoNs;
   }
-  int nSocks = nSocksPerThread * nThreads;
+  int nSocks;
+  if (nSocksPerThread == -2) nSocks = autoNs * autoNt;
+  else nSocks = nSocksPerThread * std::max(autoNt, 1);
   if (nSocks > MAX_SOCKETS) {
-    nSocksPerThread = MAX_SOCKETS/nThreads;
-    WARN("NET/Socket : the total number of sockets is greater than the maximum allowed, setting NCCL_NSOCKS_PERTHREAD to %d", nSocksPerThread);
-    nSocks = nSocksPerThread * nThreads;
+    WARN("NET/Socket : the total number of sockets is greater than the maximum allowed, setting it to %d", MAX_SOCKETS);
+    nSocks = MAX_SOCKETS;
   }
-  *ns = nSocks;
-  *nt = nThreads;
-  if (nSocks > 0) INFO(NCCL_INIT, "NET/Socket: Using %d threads and %d sockets per thread", nThreads, nSocksPerThread);
+  *ns = std::max(nSocks, 0);
+  if (nSocks > 0) INFO(NCCL_INIT, "NET/Socket: Using %d sockets per connection", nSocks);
   return ncclSuccess;
 }
 
@@ -282,6 +1316,78 @@ ncclResult_t ncclSocketNewComm(struct ncclSocketComm** comm) {
   return ncclSuccess;
 }
 
+// Other interfaces a connection on dev is bonded with : the IPv4 interfaces
+// other than dev, in the order they were found.
+static ncclResult_t ncclSocketGetBondDevs(int dev, int* bondDevs, int* nBondDevs) {
+  *nBondDevs = 0;
+  if (ncclParamSocketBond() == 0 || ncclSocketDevs[dev].addr.sa.sa_family != AF_INET) return ncclSuccess;
+  for (int d=0; d<ncclNetIfs && *nBondDevs < MAX_BOND_IFS-1; d++) {
+    if (d == dev || ncclSocketDevs[d].addr.sa.sa_family != AF_INET) continue;
+    if (ncclSocketDevs[d].addr.sin.sin_addr.s_addr == ncclSocketDevs[dev].addr.sin.sin_addr.s_addr) continue;
+    bondDevs[(*nBondDevs)++] = d;
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclSocketBondListen(struct ncclSocketListenComm* comm, struct ncclSocketHandle* handle) {
+  int bondDevs[MAX_BOND_IFS-1], nBondDevs;
+  NCCLCHECK(ncclSocketGetBondDevs(comm->dev, bondDevs, &nBondDevs));
+  if (nBondDevs == 0) {
+    if (ncclParamSocketBond()) INFO(NCCL_NET, "NET/Socket : no IPv4 interface to bond %s with", ncclSocketDevs[comm->dev].devName);
+    return ncclSuccess;
+  }
+  if (comm->nSocks < nBondDevs+1) {
+    INFO(NCCL_NET, "NET/Socket : %d data sockets for %d bonded interfaces, increase NCCL_NSOCKS_PERTHREAD to use all of them", comm->nSocks, nBondDevs+1);
+    nBondDevs = std::max(comm->nSocks-1, 0);
+  }
+  for (int b=0; b<nBondDevs; b++) {
+    union socketAddress addr;
+    memcpy(&addr, &ncclSocketDevs[bondDevs[b]].addr, sizeof(union socketAddress));
+    NCCLCHECK(createListenSocket(comm->bondFds+b, &addr));
+    comm->nBondFds++;
+    handle->bondAddrs[b].addr = addr.sin.sin_addr.s_addr;
+    handle->bondAddrs[b].port = addr.sin.sin_port;
+  }
+  handle->nBondAddrs = nBondDevs;
+  return ncclSuccess;
+}
+
+// Listener address data socket i connects to. The control socket and the
+// first data socket use the main address.
+static void ncclSocketGetConnectAddr(struct ncclSocketHandle* handle, int i, union socketAddress* addr) {
+  memcpy(addr, &handle->connectAddr, sizeof(union socketAddress));
+  if (i == handle->nSocks) return;
+  int a = i % (handle->nBondAddrs+1);
+  if (a == 0) return;
+  addr->sin.sin_addr.s_addr = handle->bondAddrs[a-1].addr;
+  addr->sin.sin_port = handle->bondAddrs[a-1].port;
+}
+
+// Accept the next connection on any of the listening sockets
+static ncclResult_t ncclSocketListenAccept(struct ncclSocketListenComm* lComm, int* fd) {
+  int listenFd = lComm->fd;
+  if (lComm->nBondFds) {
+    struct pollfd pfds[MAX_BOND_IFS];
+    int nfds = 0;
+    pfds[nfds++].fd = lComm->fd;
+    for (int b=0; b<lComm->nBondFds; b++) pfds[nfds++].fd = lComm->bondFds[b];
+    for (int i=0; i<nfds; i++) pfds[i].events = POLLIN;
+    int ret;
+    SYSCHECKSYNC(poll(pfds, nfds, -1), "poll", ret);
+    if (ret == -1) {
+      WARN("NET/Socket : poll failed : %s", strerror(errno));
+      return ncclSystemError;
+    }
+    for (int i=0; i<nfds; i++) {
+      if (pfds[i].revents) { listenFd = pfds[i].fd; break; }
+    }
+  }
+  struct sockaddr_in sockaddr;
+  socklen_t socklen = sizeof(struct sockaddr_in);
+  SYSCHECKVAL(accept(listenFd, (struct sockaddr*)&sockaddr, &socklen), "accept", *fd);
+  return ncclSuccess;
+}
+
 ncclResult_t ncclSocketListen(int dev, void* opaqueHandle, void** listenComm) {
   if (dev < 0) { // data transfer socket is based on specified dev
     return ncclInternalError;
@@ -292,9 +1398,17 @@ ncclResult_t ncclSocketListen(int dev, void* opaqueHandle, void** listenComm) {
   NCCLCHECK(ncclSocketNewListenComm(&comm));
   NCCLCHECK(GetSocketAddr(dev, &handle->connectAddr));
   NCCLCHECK(createListenSocket(&comm->fd, &handle->connectAddr));
-  NCCLCHECK(ncclSocketGetNsockNthread(dev, &comm->nSocks, &comm->nThreads));
+  NCCLCHECK(ncclSocketGetNsocks(dev, &comm->nSocks));
+  comm->dev = dev;
   handle->nSocks = comm->nSocks;
-  handle->nThreads = comm->nThreads;
+  handle->nBondAddrs = 0;
+  NCCLCHECK(ncclSocketBondListen(comm, handle));
+  // Accept encoded frames if we would send some ourselves
+  comm->codecs = 0;
+  if (ncclSocketGetCodec() != NCCL_CODEC_NONE) {
+    for (int c=NCCL_CODEC_NONE+1; c<NCCL_NUM_CODECS; c++) comm->codecs |= 1 << c;
+  }
+  handle->codecs = comm->codecs;
   *listenComm = comm;
   return ncclSuccess;
 }
@@ -307,14 +1421,26 @@ ncclResult_t ncclSocketConnect(int dev, void* opaqueHandle, void** sendComm) {
   NCCLCHECK(ncclSocketNewComm(&comm));
   struct ncclSocketHandle* handle = (struct ncclSocketHandle*) opaqueHandle;
   comm->nSocks = handle->nSocks;
-  comm->nThreads = handle->nThreads;
+  comm->dev = dev;
+  // Data sockets first, then the control socket
+  union socketAddress addrs[MAX_SOCKETS+1];
+  int fds[MAX_SOCKETS+1];
+  for (int i=0; i<comm->nSocks+1; i++) ncclSocketGetConnectAddr(handle, i, addrs+i);
+  NCCLCHECK(connectAddresses(fds, addrs, comm->nSocks+1));
   for (int i=0; i<comm->nSocks+1; i++) {
-    int tmpFd, offset=0;
-    NCCLCHECK(connectAddress(&tmpFd, &handle->connectAddr));
-    NCCLCHECK(socketWait(NCCL_SOCKET_SEND, tmpFd, &i, sizeof(int), &offset));
-    if (i == comm->nSocks) comm->ctrlFd = tmpFd;
-    else comm->fds[i] = tmpFd;
+    NCCLCHECK(socketSend(fds[i], &i, sizeof(int)));
+    if (i == comm->nSocks) comm->ctrlFd = fds[i];
+    else comm->fds[i] = fds[i];
+  }
+  NCCLCHECK(ncclSocketZcEnable(comm));
+  NCCLCHECK(ncclSocketSetLowat(comm));
+  NCCLCHECK(ncclSocketSetBusyPoll(comm));
+  comm->codec = ncclSocketGetCodec();
+  if ((handle->codecs & (1 << comm->codec)) == 0) {
+    if (comm->codec != NCCL_CODEC_NONE) INFO(NCCL_NET, "NET/Socket : peer does not accept %s frames, sending them unencoded", ncclCodecs[comm->codec].name);
+    comm->codec = NCCL_CODEC_NONE;
   }
+  NCCLCHECK(ncclSocketAllocCodecBufs(comm));
   *sendComm = comm;
   return ncclSuccess;
 }
@@ -324,72 +1450,261 @@ ncclResult_t ncclSocketAccept(void* listenComm, void** recvComm) {
   struct ncclSocketComm* rComm;
   NCCLCHECK(ncclSocketNewComm(&rComm));
   rComm->nSocks = lComm->nSocks;
-  rComm->nThreads = lComm->nThreads;
+  rComm->dev = lComm->dev;
   for (int i=0; i<rComm->nSocks+1; i++) {
     int tmpFd, sendSockIdx, offset=0;
-    struct sockaddr_in sockaddr;
-    socklen_t socklen = sizeof(struct sockaddr_in);
-    SYSCHECKVAL(accept(lComm->fd, (struct sockaddr*)&sockaddr, &socklen), "accept", tmpFd);
+    NCCLCHECK(ncclSocketListenAccept(lComm, &tmpFd));
     NCCLCHECK(socketWait(NCCL_SOCKET_RECV, tmpFd, &sendSockIdx, sizeof(int), &offset));
     if (sendSockIdx == rComm->nSocks) rComm->ctrlFd = tmpFd;
     else rComm->fds[sendSockIdx] = tmpFd;
   }
+  NCCLCHECK(ncclSocketSetBusyPoll(rComm));
+  rComm->codecs = lComm->codecs;
+  NCCLCHECK(ncclSocketAllocCodecBufs(rComm));
   *recvComm = rComm;
   return ncclSuccess;
 }
 
 ncclResult_t ncclSocketGetRequest(struct ncclSocketComm* comm, int op, void* data, int size, struct ncclSocketRequest** req) {
-  for (int i=0; i<MAX_REQUESTS; i++) {
-    struct ncclSocketRequest* r = comm->requests+i;
-    if (r->used == 0) {
-      r->op = op;
-      r->data = data;
-      r->size = size;
-      r->ctrlFd = comm->ctrlFd;
-      r->used = 1;
-      r->comm = comm;
-      r->nSubs = 0;
-      *req = r;
+  if (comm->freeReqs == NULL) {
+    if (comm->nRequests == MAX_REQUESTS) {
+      // Too many requests in flight, let the caller retry later
+      comm->reqWaits++;
+      *req = NULL;
       return ncclSuccess;
     }
+    struct ncclSocketRequestChunk* chunk;
+    NCCLCHECK(ncclCalloc(&chunk, 1));
+    chunk->next = comm->reqChunks;
+    comm->reqChunks = chunk;
+    for (int i=REQUEST_CHUNK-1; i>=0; i--) {
+      chunk->requests[i].next = comm->freeReqs;
+      comm->freeReqs = chunk->requests+i;
+    }
+    comm->nRequests += REQUEST_CHUNK;
   }
-  WARN("NET/Socket : unable to allocate requests");
-  return ncclInternalError;
+  struct ncclSocketRequest* r = comm->freeReqs;
+  comm->freeReqs = r->next;
+  r->op = op;
+  r->data = data;
+  r->size = size;
+  r->ctrlFd = comm->ctrlFd;
+  r->used = 1;
+  r->comm = comm;
+  r->nSubs = 0;
+  r->nCompleted = 0;
+  r->posted = 0;
+  r->next = NULL;
+  if (op == NCCL_SOCKET_SEND) comm->ctrlQueue[comm->ctrlTail++%MAX_REQUESTS] = r;
+  *req = r;
+  return ncclSuccess;
 }
 
-ncclResult_t ncclSocketGetTask(struct ncclSocketComm* comm, int op, void* data, int size, struct ncclSocketTask** req) {
-  int tid = comm->nextFd % comm->nThreads;
-  struct ncclSocketThreadResources* res = comm->threadResources+tid;
-  struct ncclSocketTaskQueue* queue = &res->threadTaskQueue;
-  // create helper threads and prepare per-thread task queue
-  if (queue->tasks == NULL) {
-    NCCLCHECK(ncclCalloc(&queue->tasks, MAX_QUEUE_LEN));
-    queue->next = 0;
-    res->comm = comm;
-    pthread_mutex_init(&res->threadLock, NULL);
-    pthread_cond_init(&res->threadCond, NULL);
-    pthread_create(comm->helperThread+tid, NULL, persistentSocketThread, res);
-  }
-  struct ncclSocketTask* r = queue->tasks+queue->next;
-  if (r->used == 0) {
-    r->op = op;
-    r->data = data;
-    r->size = size;
-    r->fd = comm->fds[comm->nextFd];
-    r->offset = 0;
-    r->result = ncclSuccess;
-    comm->nextFd = (comm->nextFd + 1) % comm->nSocks;
-    r->used = 1;
-    *req = r;
-    pthread_mutex_lock(&res->threadLock);
-    queue->next = (queue->next+1)%MAX_QUEUE_LEN;
-    res->state = start;
-    pthread_cond_signal(&res->threadCond);
-    pthread_mutex_unlock(&res->threadLock);
-    return ncclSuccess;
+static void ncclSocketFreeRequest(struct ncclSocketRequest* r) {
+  struct ncclSocketComm* comm = r->comm;
+  for (int i=0; i<r->nSubs; i++) {
+    r->tasks[i]->next = comm->freeTasks;
+    comm->freeTasks = r->tasks[i];
   }
-  WARN("NET/Socket : unable to allocate subtasks");
-  return ncclInternalError;
+  r->used = 0;
+  r->next = comm->freeReqs;
+  comm->freeReqs = r;
+}
+
+static ncclResult_t ncclSocketGetTask(struct ncclSocketRequest* req, int sub, struct ncclSocketTask** task) {
+  struct ncclSocketComm* comm = req->comm;
+  if (comm->freeTasks == NULL) {
+    struct ncclSocketTaskChunk* chunk;
+    NCCLCHECK(ncclCalloc(&chunk, 1));
+    chunk->next = comm->taskChunks;
+    comm->taskChunks = chunk;
+    for (int i=TASK_CHUNK-1; i>=0; i--) {
+      chunk->tasks[i].next = comm->freeTasks;
+      comm->freeTasks = chunk->tasks+i;
+    }
+  }
+  struct ncclSocketTask* r = comm->freeTasks;
+  comm->freeTasks = r->next;
+  int sockIdx = (req->sock + sub) % comm->nSocks;
+  struct ncclSocketSock* sock = comm->socks+sockIdx;
+  r->op = req->op;
+  r->data = NULL;
+  r->size = 0;
+  r->fd = sock->fd;
+  r->offset = 0;
+  r->sub = sub;
+  r->sockIdx = sockIdx;
+  r->state = taskStart;
+  r->bytes = 0;
+  r->result = ncclSuccess;
+  r->req = req;
+  // Zero-copy sends are only handled by the epoll-based threads
+  r->zc = (sock->zc && req->op == NCCL_SOCKET_SEND && ncclSocketPool.uring == 0 && DIVUP(req->size, req->nSubs) >= ncclParamSocketZeroCopyThreshold()) ? sock->zc : NULL;
+  sock->tasks[(sock->sched >> 1)%MAX_QUEUE_LEN] = r;
+  *task = r;
+  return ncclSocketSockPost(&ncclSocketPool, sock);
+}
+
+/* Each data socket has room for MAX_QUEUE_LEN tasks which its pool thread
+ * did not complete yet. Requests wait in the post queue until all their
+ * sockets have room, so that tasks are queued on each socket in the order
+ * requests started, as they are on the other side.
+ */
+static int ncclSocketCanPost(struct ncclSocketRequest* r) {
+  struct ncclSocketComm* comm = r->comm;
+  for (int i=0; i<r->nSubs; i++) {
+    struct ncclSocketSock* sock = comm->socks+(r->sock+i)%comm->nSocks;
+    if ((sock->sched >> 1) - sock->done >= MAX_QUEUE_LEN) return 0;
+  }
+  return 1;
+}
+
+static ncclResult_t ncclSocketPostQueued(struct ncclSocketComm* comm) {
+  while (comm->postHead && ncclSocketCanPost(comm->postHead)) {
+    struct ncclSocketRequest* r = comm->postHead;
+    comm->postHead = r->next;
+    for (int i=0; i<r->nSubs; i++) NCCLCHECK(ncclSocketGetTask(r, i, r->tasks+i));
+    r->posted = 1;
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclSocketPost(struct ncclSocketRequest* r) {
+  struct ncclSocketComm* comm = r->comm;
+  if (comm->socks == NULL) NCCLCHECK(ncclSocketPoolAttach(comm));
+  r->sock = comm->nextFd;
+  comm->nextFd = (comm->nextFd + r->nSubs) % comm->nSocks;
+  if (r->op == NCCL_SOCKET_SEND) ncclSocketSplit(r);
+  if (comm->postHead) {
+    comm->postTail->next = r;
+  } else {
+    comm->postHead = r;
+  }
+  comm->postTail = r;
+  NCCLCHECK(ncclSocketPostQueued(comm));
+  if (r->posted == 0) comm->postWaits++;
+  return ncclSuccess;
+}
+
+/* Control socket protocol : each message starts with a 4-byte header
+ * carrying its size. Payloads of small messages, or of all messages when
+ * there are no data sockets, follow their header on ctrlFd ; larger payloads
+ * are split over the data sockets. Headers of several queued sends are sent
+ * with a single system call.
+ */
+static int ncclSocketInline(struct ncclSocketComm* comm, int size) {
+  return comm->nSocks == 0 || size <= MAX_INLINE_SIZE;
+}
+
+// The header is complete, start moving the payload
+static ncclResult_t ncclSocketStart(struct ncclSocketRequest* r) {
+  r->offset = 0;
+  r->used = 2; // done exchanging size
+  // divide into subtasks, one per socket
+  if (!ncclSocketInline(r->comm, r->size)) {
+    int taskSize = std::max(MIN_CHUNKSIZE, DIVUP(r->size, r->comm->nSocks));
+    r->nSubs = DIVUP(r->size, taskSize);
+    r->started = 0;
+    NCCLCHECK(ncclSocketPost(r));
+  }
+  return ncclSuccess;
+}
+
+// Send the headers of queued requests, with inline payloads
+static ncclResult_t ncclSocketCtrlSend(struct ncclSocketComm* comm) {
+  if (comm->ctrlBusy || comm->ctrlHead == comm->ctrlTail) return ncclSuccess;
+  struct iovec iov[2*MAX_CTRL_BATCH];
+  int nReqs = 0, nIov = 0;
+  for (uint64_t i=comm->ctrlHead; i<comm->ctrlTail && nReqs<MAX_CTRL_BATCH; i++, nReqs++) {
+    struct ncclSocketRequest* r = comm->ctrlQueue[i%MAX_REQUESTS];
+    iov[nIov].iov_base = &r->size;
+    iov[nIov++].iov_len = sizeof(int);
+    if (r->size > 0 && ncclSocketInline(comm, r->size)) {
+      iov[nIov].iov_base = r->data;
+      iov[nIov++].iov_len = r->size;
+    }
+  }
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = nIov;
+  int bytes = sendmsg(comm->ctrlFd, &msg, MSG_DONTWAIT);
+  if (bytes == -1) {
+    if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) return ncclSuccess; /* Not ready -- retry later */
+    WARN("Call to sendmsg failed : %s", strerror(errno));
+    return ncclSystemError;
+  }
+  for (int i=0; i<nReqs && bytes > 0; i++) {
+    struct ncclSocketRequest* r = comm->ctrlQueue[comm->ctrlHead++%MAX_REQUESTS];
+    int offset = std::min(bytes, (int)sizeof(int));
+    bytes -= offset;
+    // Not sure we could ever send less than 4 bytes, but just in case ...
+    if (offset < sizeof(int)) NCCLCHECK(socketWait(NCCL_SOCKET_SEND, comm->ctrlFd, &r->size, sizeof(int), &offset));
+    NCCLCHECK(ncclSocketStart(r));
+    if (ncclSocketInline(comm, r->size)) {
+      r->offset = std::min(bytes, r->size);
+      bytes -= r->offset;
+      __sync_fetch_and_add(&comm->copiedBytes, r->offset);
+      if (r->offset < r->size) comm->ctrlBusy = r;
+    }
+  }
+  return ncclSuccess;
+}
+
+// Copy data received on ctrlFd, reading more from the socket if needed
+static ncclResult_t ncclSocketCtrlRead(struct ncclSocketComm* comm, void* data, int size, int* offset) {
+  int avail = comm->ctrlBufTail - comm->ctrlBufHead;
+  if (avail == 0 && size-*offset >= CTRL_BUF_SIZE) {
+    // Large payload, receive it directly
+    return socketProgress(NCCL_SOCKET_RECV, comm->ctrlFd, data, size, offset);
+  }
+  if (avail < size-*offset) {
+    if (avail == 0) comm->ctrlBufHead = comm->ctrlBufTail = 0;
+    if (comm->ctrlBufTail == CTRL_BUF_SIZE) {
+      memmove(comm->ctrlBuf, comm->ctrlBuf+comm->ctrlBufHead, avail);
+      comm->ctrlBufHead = 0;
+      comm->ctrlBufTail = avail;
+    }
+    if (comm->ctrlBufTail < CTRL_BUF_SIZE) {
+      NCCLCHECK(socketProgress(NCCL_SOCKET_RECV, comm->ctrlFd, comm->ctrlBuf, CTRL_BUF_SIZE, &comm->ctrlBufTail));
+      avail = comm->ctrlBufTail - comm->ctrlBufHead;
+    }
+  }
+  int bytes = std::min(avail, size-*offset);
+  memcpy((char*)data+*offset, comm->ctrlBuf+comm->ctrlBufHead, bytes);
+  comm->ctrlBufHead += bytes;
+  *offset += bytes;
+  return ncclSuccess;
+}
+
+static ncclResult_t ncclSocketCtrlRecv(struct ncclSocketComm* comm, struct ncclSocketRequest* r) {
+  if (comm->ctrlBusy) return ncclSuccess;
+  // Only consume the header once it was entirely received
+  int data, offset = 0;
+  if (comm->ctrlBufTail - comm->ctrlBufHead < sizeof(int)) {
+    if (comm->ctrlBufHead > CTRL_BUF_SIZE-sizeof(int)) {
+      int avail = comm->ctrlBufTail - comm->ctrlBufHead;
+      memmove(comm->ctrlBuf, comm->ctrlBuf+comm->ctrlBufHead, avail);
+      comm->ctrlBufHead = 0;
+      comm->ctrlBufTail = avail;
+    }
+    NCCLCHECK(socketProgress(NCCL_SOCKET_RECV, comm->ctrlFd, comm->ctrlBuf, CTRL_BUF_SIZE, &comm->ctrlBufTail));
+    if (comm->ctrlBufTail - comm->ctrlBufHead < sizeof(int)) return ncclSuccess; /* Not ready -- retry later */
+  }
+  NCCLCHECK(ncclSocketCtrlRead(comm, &data, sizeof(int), &offset));
+
+  // Check size is less or equal to the size provided by the user
+  if (data > r->size) {
+    WARN("NET/Socket : message truncated : receiving %d bytes instead of %d", data, r->size);
+    return ncclInternalError;
+  }
+  r->size = data;
+  NCCLCHECK(ncclSocketStart(r));
+  if (ncclSocketInline(comm, r->size)) {
+    NCCLCHECK(ncclSocketCtrlRead(comm, r->data, r->size, &r->offset));
+    if (r->offset < r->size) comm->ctrlBusy = r;
+  }
+  return ncclSuccess;
 }
 
 ncclResult_t ncclSocketTest(void* request, int* done, int* size) {
@@ -399,61 +1714,52 @@ ncclResult_t ncclSocketTest(void* request, int* done, int* size) {
     WARN("NET/Socket : test called with NULL request");
     return ncclInternalError;
   }
+  struct ncclSocketComm* comm = r->comm;
   if (r->used == 1) { /* try to send/recv size */
-    int data = r->size;
-    int offset = 0;
-    NCCLCHECK(socketProgress(r->op, r->ctrlFd, &data, sizeof(int), &offset));
-
-    if (offset == 0) return ncclSuccess; /* Not ready -- retry later */
-
-    // Not sure we could ever receive less than 4 bytes, but just in case ...
-    if (offset < sizeof(int)) NCCLCHECK(socketWait(r->op, r->ctrlFd, &data, sizeof(int), &offset));
-
-    // Check size is less or equal to the size provided by the user
-    if (r->op == NCCL_SOCKET_RECV && data > r->size) {
-      WARN("NET/Socket : message truncated : receiving %d bytes instead of %d", data, r->size);
-      return ncclInternalError;
-    }
-    r->size = data;
-    r->offset = 0;
-    r->used = 2; // done exchanging size
-    // divide into subtasks
-    int chunkOffset = 0, i = 0;
-    if (r->comm->nSocks > 0) {
-      int taskSize = std::max(MIN_CHUNKSIZE, DIVUP(r->size, r->comm->nSocks));
-      while (chunkOffset < r->size) {
-        int chunkSize = std::min(taskSize, r->size-chunkOffset);
-        NCCLCHECK(ncclSocketGetTask(r->comm, r->op, (char*)(r->data)+chunkOffset, chunkSize, r->tasks+i++));
-        chunkOffset += chunkSize;
-      }
+    if (r->op == NCCL_SOCKET_SEND) {
+      NCCLCHECK(ncclSocketCtrlSend(comm));
+    } else {
+      NCCLCHECK(ncclSocketCtrlRecv(comm, r));
     }
-    r->nSubs = i;
+    if (r->used == 1) return ncclSuccess; /* Not ready -- retry later */
   }
   if (r->used == 2) { // already exchanged size
     if (r->nSubs > 0) {
-      int nCompleted = 0;
-      for (int i=0; i<r->nSubs; i++) {
-        struct ncclSocketTask* sub = r->tasks[i];
-        if (sub->result != ncclSuccess) return sub->result;
-        if (sub->offset == sub->size) nCompleted++;
+      if (ncclSocketPool.failed) {
+        WARN("NET/Socket : helper threads failed");
+        return ncclSystemError;
       }
-      if (nCompleted == r->nSubs) {
-        if (size) *size = r->size;
-        *done = 1;
-        r->used = 0;
+      if (r->posted == 0) {
+        NCCLCHECK(ncclSocketPostQueued(comm));
+        if (r->posted == 0) return ncclSuccess; /* Sockets are full -- retry later */
+      }
+      if (*(volatile int*)&r->nCompleted < r->nSubs) {
         for (int i=0; i<r->nSubs; i++) {
           struct ncclSocketTask* sub = r->tasks[i];
-          sub->used = 0;
+          if (sub->result != ncclSuccess) return sub->result;
         }
+      } else {
+        if (size) *size = r->size;
+        *done = 1;
+        ncclSocketFreeRequest(r);
       }
-    } else { // progress request using main thread
+    } else { // progress inline payload using main thread
       if (r->offset < r->size) {
-        NCCLCHECK(socketProgress(r->op, r->ctrlFd, r->data, r->size, &r->offset));
+        int offset = r->offset;
+        if (r->op == NCCL_SOCKET_SEND) {
+          NCCLCHECK(socketProgress(r->op, r->ctrlFd, r->data, r->size, &r->offset));
+          __sync_fetch_and_add(&comm->copiedBytes, r->offset-offset);
+        } else {
+          NCCLCHECK(ncclSocketCtrlRead(comm, r->data, r->size, &r->offset));
+        }
       }
       if (r->offset == r->size) {
+        if (comm->ctrlBusy == r) comm->ctrlBusy = NULL;
         if (size) *size = r->size;
         *done = 1;
-        r->used = 0;
+        ncclSocketFreeRequest(r);
+        // Headers may be waiting behind this payload
+        if (r->op == NCCL_SOCKET_SEND) NCCLCHECK(ncclSocketCtrlSend(comm));
       }
     }
   }
@@ -486,6 +1792,7 @@ ncclResult_t ncclSocketCloseListen(void* opaqueComm) {
   struct ncclSocketListenComm* comm = (struct ncclSocketListenComm*)opaqueComm;
   if (comm) {
     if (comm->fd != -1) close(comm->fd);
+    for (int b=0; b<comm->nBondFds; b++) close(comm->bondFds[b]);
     free(comm);
   }
   return ncclSuccess;
@@ -494,16 +1801,24 @@ ncclResult_t ncclSocketCloseListen(void* opaqueComm) {
 ncclResult_t ncclSocketClose(void* opaqueComm) {
   struct ncclSocketComm* comm = (struct ncclSocketComm*)opaqueComm;
   if (comm) {
-    for (int i=0; i<comm->nThreads; i++) {
-      struct ncclSocketThreadResources* res = comm->threadResources+i;
-      if (comm->helperThread[i]) {
-        pthread_mutex_lock(&res->threadLock);
-        res->state = stop;
-        pthread_cond_signal(&res->threadCond);
-        pthread_mutex_unlock(&res->threadLock);
-        pthread_join(comm->helperThread[i], NULL);
-      }
-      free(res->threadTaskQueue.tasks);
+    if (comm->socks) NCCLCHECK(ncclSocketPoolDetach(comm));
+    if (comm->steals) INFO(NCCL_NET, "NET/Socket : %lu frames were moved to a faster socket", comm->steals);
+    if (comm->reqWaits || comm->postWaits) INFO(NCCL_NET, "NET/Socket : %d requests allocated, %lu posts deferred for lack of requests, %lu requests waited for room on data sockets", comm->nRequests, comm->reqWaits, comm->postWaits);
+    while (comm->reqChunks) {
+      struct ncclSocketRequestChunk* chunk = comm->reqChunks;
+      comm->reqChunks = chunk->next;
+      free(chunk);
+    }
+    while (comm->taskChunks) {
+      struct ncclSocketTaskChunk* chunk = comm->taskChunks;
+      comm->taskChunks = chunk->next;
+      free(chunk);
+    }
+    if (comm->encodedBytes) INFO(NCCL_NET, "NET/Socket : %s codec sent %lu bytes as %lu bytes", ncclCodecs[comm->codec].name, comm->encodedBytes, comm->encodedWireBytes);
+    free(comm->codecBufs);
+    if (comm->zc) {
+      INFO(NCCL_NET, "NET/Socket : sent %lu bytes with zero-copy, %lu bytes copied", comm->zcBytes, comm->copiedBytes);
+      free(comm->zc);
     }
     if (comm->ctrlFd != -1) close(comm->ctrlFd);
     for (int i=0; i<comm->nSocks; i++) {